@@ -328,3 +328,89 @@ else
     echo "SUCCESS: Directory hardlink rejected"
     rm -rf "$MOUNT/testdir"
 fi
+
+# Test 26: Sparse file
+echo ""
+echo "26. Sparse file"
+if printf "x" | dd of="$MOUNT/sparse" bs=1 seek=3221225472 conv=notrunc 2>/dev/null; then
+    size=$(stat -c %s "$MOUNT/sparse")
+    zeros=$(head -c 4096 "$MOUNT/sparse" | tr -d '\0' | wc -c)
+    if [ "$size" -eq 3221225473 ] && [ "$zeros" -eq 0 ] && [ "$(tail -c 1 "$MOUNT/sparse")" = "x" ]; then
+        echo "SUCCESS: Hole past 2 GiB reads back as zeros"
+        rm "$MOUNT/sparse"
+    else
+        echo "FAIL: Sparse file mismatch (size $size)"
+        exit 1
+    fi
+else
+    echo "FAIL: dd returned $?"
+    exit 1
+fi
+
+# Test 27: Truncate
+echo ""
+echo "27. Truncate"
+head -c 65536 /dev/urandom > "$MOUNT/trunc"
+if truncate -s 10 "$MOUNT/trunc" && truncate -s 20 "$MOUNT/trunc"; then
+    tail_zeros=$(tail -c 10 "$MOUNT/trunc" | tr -d '\0' | wc -c)
+    if [ "$(stat -c %s "$MOUNT/trunc")" -eq 20 ] && [ "$tail_zeros" -eq 0 ]; then
+        echo "SUCCESS: Truncate shrinks and regrows with zeros"
+        rm "$MOUNT/trunc"
+    else
+        echo "FAIL: Truncate mismatch"
+        exit 1
+    fi
+else
+    echo "FAIL: truncate returned $?"
+    exit 1
+fi
+
+# Test 28: Large directory listing
+echo ""
+echo "28. Large directory listing"
+mkdir "$MOUNT/bigdir"
+for i in $(seq 1 1000); do
+    : > "$MOUNT/bigdir/f$i"
+done
+count=$(ls -f "$MOUNT/bigdir" | wc -l)
+if [ "$count" -eq 1002 ]; then
+    echo "SUCCESS: Listed all 1000 entries"
+    rm -rf "$MOUNT/bigdir"
+else
+    echo "FAIL: Listed $count entries"
+    exit 1
+fi
+
+# Test 29: Directory link count and mtime
+echo ""
+echo "29. Directory link count and mtime"
+mkdir -p "$MOUNT/nlinkdir/a" "$MOUNT/nlinkdir/b"
+touch -d "2001-01-01" "$MOUNT/nlinkdir"
+: > "$MOUNT/nlinkdir/f"
+nlink=$(stat -c %h "$MOUNT/nlinkdir")
+year=$(date -r "$MOUNT/nlinkdir" +%Y)
+if [ "$nlink" -eq 4 ] && [ "$year" != "2001" ]; then
+    echo "SUCCESS: Subdirectories counted, mtime updated"
+    rm -rf "$MOUNT/nlinkdir"
+else
+    echo "FAIL: nlink $nlink, mtime year $year"
+    exit 1
+fi
+
+# Test 30: Direct I/O
+echo ""
+echo "30. Direct I/O"
+head -c 65536 /dev/urandom > /tmp/nifs_direct
+if dd if=/tmp/nifs_direct of="$MOUNT/direct" bs=4096 oflag=direct 2>/dev/null; then
+    if cmp -s /tmp/nifs_direct "$MOUNT/direct" && \
+       dd if="$MOUNT/direct" bs=4096 iflag=direct 2>/dev/null | cmp -s /tmp/nifs_direct -; then
+        echo "SUCCESS: O_DIRECT data matches buffered reads"
+        rm "$MOUNT/direct" /tmp/nifs_direct
+    else
+        echo "FAIL: O_DIRECT data mismatch"
+        exit 1
+    fi
+else
+    echo "FAIL: dd oflag=direct returned $?"
+    exit 1
+fi
@@ -1,212 +1,896 @@
 #include "http.h"
 
+#include <linux/hex.h>
+#include <linux/jiffies.h>
+#include <linux/net.h>
+#include <linux/slab.h>
+#include <linux/tcp.h>
+#include <net/sock.h>
+#include <net/tcp.h>
+
 const char *SERVER_IP = "0.0.0.0";
 const int SERVER_PORT = 8080;
 
-// callee should call free_request on received buffer
-int fill_request(struct kvec *vec, const char *token, const char *method,
-                 size_t arg_size, va_list args) {
-  // 2048 bytes for URL and 64 bytes for anything else
-  char *request_buffer = kzalloc(2048 + 64, GFP_KERNEL);
-  if (request_buffer == 0) {
-    return -ENOMEM;
+// Status line and headers are read through this window, one line at a time
+#define VTFS_HTTP_WINDOW_SIZE 1024
+
+struct vtfs_http_conn {
+  struct socket *sock;
+  struct list_head node;   // in vtfs_http_pool.idle
+  unsigned long last_used; // jiffies when put back to the pool
+  unsigned long deadline;  // jiffies, end of the call using the connection
+  size_t start, end;       // unconsumed bytes in window
+  char window[VTFS_HTTP_WINDOW_SIZE];
+};
+
+// Response body decoding, for both Content-Length and chunked bodies
+enum http_body_state {
+  BODY_DATA,       // remaining bytes of body or chunk to go
+  BODY_CHUNK_END,  // CRLF after chunk data
+  BODY_CHUNK_SIZE, // chunk size line
+  BODY_DONE,
+};
+
+struct http_body {
+  enum http_body_state state;
+  bool chunked;
+  u64 remaining;
+};
+
+// Request under construction. The head grows as needed and its length is
+// tracked, so appending never rescans it. A payload is not copied: it goes
+// out from the caller's memory as a second kvec after the head.
+struct http_request {
+  char *head;
+  size_t len;
+  size_t capacity;
+  int error;        // first allocation failure, checked by request_end
+  const void *body; // application/octet-stream payload, NULL for GET
+  size_t body_len;
+  struct kvec *parts; // batch payloads making up body_len, with a slot for
+  size_t part_count;  // the head first, or NULL
+};
+
+#define HTTP_REQUEST_INITIAL_SIZE 256
+
+static void request_append(struct http_request *req, const char *data,
+                           size_t len) {
+  if (req->error != 0) {
+    return;
   }
 
-  strcpy(request_buffer, "GET /api/");
-  strcat(request_buffer, method);
+  if (req->len + len > req->capacity) {
+    size_t capacity = max3(req->capacity * 2, req->len + len,
+                           (size_t)HTTP_REQUEST_INITIAL_SIZE);
+    char *head = krealloc(req->head, capacity, GFP_KERNEL);
+    if (head == 0) {
+      req->error = -ENOMEM;
+      return;
+    }
+    req->head = head;
+    req->capacity = capacity;
+  }
+
+  memcpy(req->head + req->len, data, len);
+  req->len += len;
+}
 
-  strcat(request_buffer, "?token=");
-  strcat(request_buffer, token);
+static void request_puts(struct http_request *req, const char *str) {
+  request_append(req, str, strlen(str));
+}
+
+static void request_free(struct http_request *req) {
+  kfree(req->head);
+  req->head = NULL;
+  kfree(req->parts);
+  req->parts = NULL;
+}
+
+static void request_begin(struct http_request *req, const char *token,
+                          const char *method, const void *body,
+                          size_t body_len) {
+  memset(req, 0, sizeof(struct http_request));
+  req->body = body;
+  req->body_len = body_len;
+
+  request_puts(req, body != NULL ? "POST /api/" : "GET /api/");
+  request_puts(req, method);
+
+  request_puts(req, "?token=");
+  request_puts(req, token);
+}
+
+static void request_add_arg(struct http_request *req, const char *prefix,
+                            const char *name, const char *value) {
+  request_puts(req, "&");
+  request_puts(req, prefix);
+  request_puts(req, name);
+  request_puts(req, "=");
+  request_puts(req, value);
+}
+
+static int request_end(struct http_request *req) {
+  request_puts(req, " HTTP/1.1\r\nHost: ");
+  request_puts(req, SERVER_IP);
+  request_puts(req, "\r\nConnection: keep-alive\r\n");
+
+  if (req->body != NULL) {
+    char length[24];
+    snprintf(length, sizeof(length), "%zu", req->body_len);
+
+    request_puts(req, "Content-Type: application/octet-stream\r\n");
+    request_puts(req, "Content-Length: ");
+    request_puts(req, length);
+    request_puts(req, "\r\n");
+  }
+  request_puts(req, "\r\n");
+
+  if (req->error != 0) {
+    request_free(req);
+  }
+  return req->error;
+}
+
+// Argument values go into the URL as is, callers encode() them.
+// callee should call request_free on success
+static int fill_request(struct http_request *req, const char *token,
+                        const char *method, const void *body, size_t body_len,
+                        size_t arg_size, va_list args) {
+  request_begin(req, token, method, body, body_len);
 
   for (int i = 0; i < arg_size; i++) {
-    strcat(request_buffer, "&");
-    strcat(request_buffer, va_arg(args, char *));
-    strcat(request_buffer, "=");
-    strcat(request_buffer, va_arg(args, char *));
+    const char *name = va_arg(args, char *);
+    request_add_arg(req, "", name, va_arg(args, char *));
   }
 
-  strcat(request_buffer, " HTTP/1.1\r\nHost:");
-  strcat(request_buffer, SERVER_IP);
-  strcat(request_buffer, "\r\nConnection: close\r\n\r\n");
+  return request_end(req);
+}
 
-  memset(vec, 0, sizeof(struct kvec));
-  vec->iov_base = request_buffer;
-  vec->iov_len = strlen(request_buffer);
+// Batches go to /api/batch as a single request. Arguments of the i-th
+// operation get an "<i>." prefix and its method is passed as "<i>.method":
+//   GET /api/batch?token=T&count=2&0.method=unlink&0.name=a&1.method=...
+// If operations have bodies, the batch is a POST whose body is theirs back to
+// back, in order, each operation with one getting its length as "<i>.body".
+// The response body is the usual int64 status followed by one record per
+// operation, in order: int64 return value, u64 data length, data.
+static int fill_batch_request(struct http_request *req, const char *token,
+                              const struct vtfs_http_op *ops, size_t count) {
+  size_t part_count = 0;
+  size_t body_len = 0;
+  char prefix[24];
+  char number[24];
+
+  for (size_t i = 0; i < count; i++) {
+    if (ops[i].body != NULL) {
+      part_count++;
+      body_len += ops[i].body_len;
+    }
+  }
 
-  return 0;
+  request_begin(req, token, "batch", part_count ? "" : NULL, body_len);
+  if (part_count) {
+    req->parts = kmalloc_array(part_count + 1, sizeof(struct kvec),
+                               GFP_KERNEL);
+    if (req->parts == NULL) {
+      req->error = -ENOMEM;
+    }
+  }
+  snprintf(number, sizeof(number), "%zu", count);
+  request_add_arg(req, "", "count", number);
+
+  for (size_t i = 0; i < count; i++) {
+    snprintf(prefix, sizeof(prefix), "%zu.", i);
+    request_add_arg(req, prefix, "method", ops[i].method);
+    for (size_t j = 0; j < ops[i].arg_size; j++) {
+      request_add_arg(req, prefix, ops[i].args[2 * j], ops[i].args[2 * j + 1]);
+    }
+
+    if (ops[i].body != NULL && req->parts != NULL) {
+      snprintf(number, sizeof(number), "%zu", ops[i].body_len);
+      request_add_arg(req, prefix, "body", number);
+
+      struct kvec *part = &req->parts[++req->part_count];
+      part->iov_base = (void *)ops[i].body;
+      part->iov_len = ops[i].body_len;
+    }
+  }
+
+  return request_end(req);
 }
 
-int receive_all(struct socket *sock, char *buffer, size_t buffer_size) {
+// Time left until deadline, for the socket timeout of the next blocking step.
+// Returns 0 once it has passed.
+static long time_left(unsigned long deadline) {
+  long left = (long)(deadline - jiffies);
+  return left > 0 ? left : 0;
+}
+
+// Waits no longer than what is left of the call
+static int receive_some(struct vtfs_http_conn *conn, char *buffer, size_t size,
+                        int flags) {
   struct msghdr hdr;
-  struct kvec vec;
+  struct kvec vec = {.iov_base = buffer, .iov_len = size};
+  long left = time_left(conn->deadline);
 
-  int read = 0;
+  if (left == 0) {
+    return -ETIMEDOUT;
+  }
+  WRITE_ONCE(conn->sock->sk->sk_rcvtimeo, left);
 
-  while (read < buffer_size) {
-    memset(&hdr, 0, sizeof(struct msghdr));
-    memset(&vec, 0, sizeof(struct kvec));
-    vec.iov_base = buffer + read;
-    vec.iov_len = buffer_size - read;
-    int ret = kernel_recvmsg(sock, &hdr, &vec, 1, vec.iov_len, 0);
+  memset(&hdr, 0, sizeof(struct msghdr));
+  int ret = kernel_recvmsg(conn->sock, &hdr, &vec, 1, size, flags);
+  if (ret == -EAGAIN) {
+    return -ETIMEDOUT;
+  }
+  return ret < 0 ? -4 : ret;
+}
+
+// Reads more into the window, making room first. Returns 0 on EOF.
+static int window_fill(struct vtfs_http_conn *conn) {
+  if (conn->start > 0) {
+    memmove(conn->window, conn->window + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+  }
+  if (conn->end == sizeof(conn->window)) {
+    return -6; // line too long
+  }
+
+  int ret = receive_some(conn, conn->window + conn->end,
+                         sizeof(conn->window) - conn->end, 0);
+  if (ret > 0) {
+    conn->end += ret;
+  }
+  return ret;
+}
+
+// Points *line at the next line, NUL-terminated in place without its CRLF.
+// Returns 0 if the peer closed the connection before sending anything.
+static int read_line(struct vtfs_http_conn *conn, char **line) {
+  while (true) {
+    char *start = conn->window + conn->start;
+    char *lf = memchr(start, '\n', conn->end - conn->start);
+    if (lf != NULL) {
+      *lf = '\0';
+      if (lf > start && lf[-1] == '\r') {
+        lf[-1] = '\0';
+      }
+      conn->start = lf + 1 - conn->window;
+      *line = start;
+      return 1;
+    }
+
+    bool empty = conn->start == conn->end;
+    int ret = window_fill(conn);
     if (ret == 0) {
-      break;
+      return empty ? 0 : -4;
     } else if (ret < 0) {
-      return -4;
+      return ret;
     }
-    read += ret;
   }
-
-  return read;
 }
 
-int64_t parse_http_response(char *raw_response, size_t raw_response_size,
-                            char *response, size_t response_size) {
-  char *buffer = raw_response;
+// Reads exactly len bytes: what the window still holds, then the rest
+// straight from the socket into dst
+static int read_exact(struct vtfs_http_conn *conn, char *dst, size_t len) {
+  size_t done = min(len, conn->end - conn->start);
 
-  // Read Response Line
-  {
-    char *status_line = strsep(&buffer, "\r");
-    strsep(&status_line, " ");
-    if (status_line == 0) {
-      return -6;
+  memcpy(dst, conn->window + conn->start, done);
+  conn->start += done;
+
+  while (done < len) {
+    int ret = receive_some(conn, dst + done, len - done, MSG_WAITALL);
+    if (ret <= 0) {
+      return ret < 0 ? ret : -4;
     }
-    char *status_code = strsep(&status_line, " ");
-    printk(KERN_INFO "Received response with status code %s\n", status_code);
-    if (strcmp(status_code, "200") != 0) {
-      return -5;
+    done += ret;
+  }
+  return 0;
+}
+
+// Reads up to len decoded body bytes into dst and returns how many; fewer
+// than len only at the end of the body. Framing is consumed eagerly, so the
+// state is BODY_DONE right after the last byte.
+static ssize_t body_read(struct vtfs_http_conn *conn, struct http_body *body,
+                         char *dst, size_t len) {
+  size_t done = 0;
+  char *line;
+  int ret;
+
+  while (body->state != BODY_DONE &&
+         (done < len || body->state != BODY_DATA)) {
+    switch (body->state) {
+    case BODY_DATA: {
+      size_t n = min_t(u64, len - done, body->remaining);
+      ret = read_exact(conn, dst + done, n);
+      if (ret < 0) {
+        return ret;
+      }
+      done += n;
+      body->remaining -= n;
+      if (body->remaining == 0) {
+        body->state = body->chunked ? BODY_CHUNK_END : BODY_DONE;
+      }
+      break;
+    }
+
+    case BODY_CHUNK_END:
+      ret = read_line(conn, &line);
+      if (ret <= 0) {
+        return ret == 0 ? -4 : ret;
+      }
+      if (*line != '\0') {
+        return -6;
+      }
+      body->state = BODY_CHUNK_SIZE;
+      break;
+
+    case BODY_CHUNK_SIZE:
+      ret = read_line(conn, &line);
+      if (ret <= 0) {
+        return ret == 0 ? -4 : ret;
+      }
+      *strchrnul(line, ';') = '\0'; // chunk extensions are ignored
+      if (kstrtou64(strim(line), 16, &body->remaining) != 0) {
+        return -6;
+      }
+      if (body->remaining != 0) {
+        body->state = BODY_DATA;
+        break;
+      }
+
+      // Last chunk, skip the trailer up to the empty line
+      do {
+        ret = read_line(conn, &line);
+        if (ret <= 0) {
+          return ret == 0 ? -4 : ret;
+        }
+      } while (*line != '\0');
+      body->state = BODY_DONE;
+      break;
+
+    case BODY_DONE:
+      break;
     }
   }
 
-  int length = -1;
+  return done;
+}
+
+// Parses the response as it arrives. The body starts with the int64 return
+// value of the call, which goes to *result; the rest is received directly
+// into response. Returns -ECONNRESET if the connection closed before the
+// response started.
+static int receive_response(struct vtfs_http_conn *conn, char *response,
+                            size_t response_size, size_t *response_length,
+                            int64_t *result, bool *keep_alive) {
+  struct http_body body = {.chunked = false, .remaining = 0};
+  bool have_length = false;
+  char *line;
+
+  *keep_alive = false;
+
+  // Read Response Line
+  int ret = read_line(conn, &line);
+  if (ret == 0) {
+    return -ECONNRESET;
+  } else if (ret < 0) {
+    return ret;
+  }
+  strsep(&line, " ");
+  if (line == 0) {
+    return -6;
+  }
+  char *status_code = strsep(&line, " ");
+  pr_debug("Received response with status code %s\n", status_code);
+  if (strcmp(status_code, "200") != 0) {
+    return -5;
+  }
+
+  *keep_alive = true;
 
   while (true) {
-    if (buffer == 0) {
-      return -6;
+    ret = read_line(conn, &line);
+    if (ret <= 0) {
+      return ret == 0 ? -6 : ret;
     }
-    char *header = strsep(&buffer, "\r");
-    ++header; // skip \n
-    if (strcmp(header, "") == 0) {
+    if (*line == '\0') {
       // end of headers
       break;
     }
 
-    if (strncmp(header, "Content-Length: ", 16) == 0) {
-      int error = kstrtoint(header + 16, 0, &length);
-      if (error != 0) {
+    char *name = strsep(&line, ":");
+    if (line == 0) {
+      return -6;
+    }
+    char *value = strim(line);
+
+    if (strcasecmp(name, "Content-Length") == 0) {
+      if (kstrtou64(value, 10, &body.remaining) != 0) {
         return -6;
       }
-      printk(KERN_INFO "Received response with content length %d\n", length);
+      have_length = true;
+    } else if (strcasecmp(name, "Transfer-Encoding") == 0) {
+      body.chunked = strcasecmp(value, "chunked") == 0;
+    } else if (strcasecmp(name, "Connection") == 0) {
+      *keep_alive = strcasecmp(value, "close") != 0;
     }
   }
-  ++buffer; // skip last '\n'
 
-  if (length == -1) {
+  // Chunked encoding wins over Content-Length
+  if (body.chunked) {
+    body.state = BODY_CHUNK_SIZE;
+  } else if (have_length) {
+    body.state = body.remaining ? BODY_DATA : BODY_DONE;
+  } else {
     return -6;
   }
 
-  if (buffer + length > raw_response + raw_response_size) {
-    return -6;
+  int64_t return_value;
+  ssize_t length = body_read(conn, &body, (char *)&return_value,
+                             sizeof(int64_t));
+  if (length < 0) {
+    return length;
   }
-
   if (length < sizeof(int64_t)) {
     return -7;
   }
 
-  length -= sizeof(int64_t);
-
-  if (length > response_size) {
+  length = body_read(conn, &body, response, response_size);
+  if (length < 0) {
+    return length;
+  }
+  if (body.state != BODY_DONE) {
     return -ENOSPC;
   }
 
-  int64_t return_value;
-  memcpy(&return_value, buffer, sizeof(int64_t));
-
-  buffer += sizeof(int64_t);
-  memcpy(response, buffer, length);
-
-  return return_value;
+  *response_length = length;
+  *result = return_value;
+  return 0;
 }
 
-int64_t vtfs_http_call(const char *token, const char *method,
-                            char *response_buffer, size_t buffer_size,
-                            size_t arg_size, ...) {
-  struct socket *sock;
-  int64_t error;
+// Connecting waits no longer than the call may still take
+static struct vtfs_http_conn *vtfs_http_conn_open(unsigned long deadline) {
+  struct vtfs_http_conn *conn = kzalloc(sizeof(*conn), GFP_KERNEL);
+  if (conn == NULL) {
+    return ERR_PTR(-ENOMEM);
+  }
 
-  error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
+  int error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP,
+                               &conn->sock);
   if (error < 0) {
-    return -1;
+    kfree(conn);
+    return ERR_PTR(-1);
   }
 
   struct sockaddr_in s_addr = {.sin_family = AF_INET,
                                .sin_addr = {.s_addr = in_aton(SERVER_IP)},
                                .sin_port = htons(SERVER_PORT)};
 
-  error = kernel_connect(sock, (struct sockaddr *)&s_addr,
-                         sizeof(struct sockaddr_in), 0);
+  long left = time_left(deadline);
+  if (left > 0) {
+    WRITE_ONCE(conn->sock->sk->sk_sndtimeo, left); // bounds a blocking connect
+    error = kernel_connect(conn->sock, (struct sockaddr *)&s_addr,
+                           sizeof(struct sockaddr_in), 0);
+  }
+  if (left == 0 || error != 0) {
+    sock_release(conn->sock);
+    kfree(conn);
+    return ERR_PTR(time_left(deadline) == 0 ? -ETIMEDOUT : -2);
+  }
+
+  // Requests are small and each waits for its answer, don't let Nagle hold them
+  tcp_sock_set_nodelay(conn->sock->sk);
+  return conn;
+}
+
+static void vtfs_http_conn_close(struct vtfs_http_conn *conn) {
+  kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+  sock_release(conn->sock);
+  kfree(conn);
+}
+
+// An idle connection is only usable if the server hasn't closed it and
+// hasn't sent anything we didn't ask for
+static bool vtfs_http_conn_alive(struct vtfs_http_conn *conn) {
+  struct sock *sk = conn->sock->sk;
+
+  if (time_after(jiffies, conn->last_used + VTFS_HTTP_IDLE_TIMEOUT)) {
+    return false;
+  }
+  return conn->start == conn->end &&
+         READ_ONCE(sk->sk_state) == TCP_ESTABLISHED &&
+         !(READ_ONCE(sk->sk_shutdown) & RCV_SHUTDOWN) &&
+         skb_queue_empty_lockless(&sk->sk_receive_queue);
+}
+
+int vtfs_http_pool_init(struct vtfs_http_pool *pool) {
+  mutex_init(&pool->lock);
+  INIT_LIST_HEAD(&pool->idle);
+  pool->idle_count = 0;
+
+  atomic_set(&pool->queued, 0);
+  init_waitqueue_head(&pool->wait);
+  pool->wq = alloc_workqueue("vtfs_http", WQ_UNBOUND | WQ_MEM_RECLAIM,
+                             VTFS_HTTP_WORKERS);
+  if (pool->wq == NULL) {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void vtfs_http_pool_drain(struct vtfs_http_pool *pool) {
+  wait_event(pool->wait, atomic_read(&pool->queued) == 0);
+}
+
+void vtfs_http_pool_destroy(struct vtfs_http_pool *pool) {
+  struct vtfs_http_conn *conn, *tmp;
+
+  if (pool->wq != NULL) {
+    destroy_workqueue(pool->wq); // runs what's still queued
+    pool->wq = NULL;
+  }
+
+  list_for_each_entry_safe(conn, tmp, &pool->idle, node) {
+    list_del(&conn->node);
+    vtfs_http_conn_close(conn);
+  }
+  pool->idle_count = 0;
+}
+
+// Takes an idle connection that passes the health check, or opens a new one
+static struct vtfs_http_conn *vtfs_http_pool_get(struct vtfs_http_pool *pool,
+                                                 bool *reused,
+                                                 unsigned long deadline) {
+  struct vtfs_http_conn *conn;
+
+  mutex_lock(&pool->lock);
+  while (!list_empty(&pool->idle)) {
+    conn = list_first_entry(&pool->idle, struct vtfs_http_conn, node);
+    list_del(&conn->node);
+    pool->idle_count--;
+
+    if (vtfs_http_conn_alive(conn)) {
+      mutex_unlock(&pool->lock);
+      *reused = true;
+      return conn;
+    }
+    vtfs_http_conn_close(conn);
+  }
+  mutex_unlock(&pool->lock);
+
+  *reused = false;
+  return vtfs_http_conn_open(deadline);
+}
+
+static void vtfs_http_pool_put(struct vtfs_http_pool *pool,
+                               struct vtfs_http_conn *conn) {
+  mutex_lock(&pool->lock);
+  if (pool->idle_count < VTFS_HTTP_POOL_SIZE) {
+    conn->last_used = jiffies;
+    list_add(&conn->node, &pool->idle);
+    pool->idle_count++;
+    conn = NULL;
+  }
+  mutex_unlock(&pool->lock);
+
+  if (conn != NULL) {
+    vtfs_http_conn_close(conn);
+  }
+}
+
+// Sends the request and reads the response, see receive_response. Every
+// blocking step only waits for what is left until deadline, and the call
+// fails with -ETIMEDOUT once it has passed.
+static int vtfs_http_exchange(struct vtfs_http_conn *conn,
+                              const struct http_request *req, char *response,
+                              size_t response_size, size_t *response_length,
+                              int64_t *result, bool *keep_alive,
+                              unsigned long deadline) {
+  struct kvec vec[2] = {
+      {.iov_base = req->head, .iov_len = req->len},
+      {.iov_base = (void *)req->body, .iov_len = req->body_len},
+  };
+  size_t total = req->len + req->body_len;
+  struct kvec *parts = vec;
+  size_t part_count = req->body_len ? 2 : 1;
+
+  // A batch body goes out straight from its operations' buffers
+  if (req->parts != NULL) {
+    req->parts[0] = vec[0];
+    parts = req->parts;
+    part_count = req->part_count + 1;
+  }
+
+  conn->deadline = deadline;
+  long left = time_left(deadline);
+  if (left == 0) {
+    return -ETIMEDOUT;
+  }
+  WRITE_ONCE(conn->sock->sk->sk_sndtimeo, left);
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(struct msghdr));
+
+  int error = kernel_sendmsg(conn->sock, &msg, parts, part_count, total);
+  if (error < 0 || error != total) {
+    return time_left(deadline) == 0 ? -ETIMEDOUT : -3;
+  }
+
+  return receive_response(conn, response, response_size, response_length,
+                          result, keep_alive);
+}
+
+// Sends a request built by fill_request and frees it. deadline (jiffies)
+// bounds the whole call, the retry over a fresh connection included.
+static int64_t vtfs_http_send(struct vtfs_http_pool *pool,
+                              struct http_request *req,
+                              char *response_buffer, size_t buffer_size,
+                              size_t *response_length,
+                              unsigned long deadline) {
+  size_t length = 0;
+  int64_t result = 0;
+  bool keep_alive;
+  int error;
+
+  while (true) {
+    bool reused;
+    struct vtfs_http_conn *conn = vtfs_http_pool_get(pool, &reused, deadline);
+    if (IS_ERR(conn)) {
+      error = PTR_ERR(conn);
+      break;
+    }
+
+    error = vtfs_http_exchange(conn, req, response_buffer, buffer_size,
+                               &length, &result, &keep_alive, deadline);
+    if (error == 0 && keep_alive) {
+      vtfs_http_pool_put(pool, conn);
+      break;
+    }
+    vtfs_http_conn_close(conn);
+
+    // The server may drop a pooled connection just as we pick it up. If it did
+    // so before answering, the request is sent again over a fresh one.
+    if (!reused || (error != -ECONNRESET && error != -3)) {
+      break;
+    }
+  }
+  request_free(req);
+
+  if (error == -ECONNRESET) {
+    error = -4;
+  }
   if (error != 0) {
+    return error;
+  }
 
-    sock_release(sock);
-    return -2;
+  if (response_length != NULL) {
+    *response_length = length;
   }
+  return result;
+}
 
-  struct kvec kvec;
+int64_t vtfs_http_call(struct vtfs_http_pool *pool, const char *token,
+                       const char *method, char *response_buffer,
+                       size_t buffer_size, size_t *response_length,
+                       size_t arg_size, ...) {
+  struct http_request req;
   va_list args;
   va_start(args, arg_size);
-  error = fill_request(&kvec, token, method, arg_size, args);
+  int64_t error = fill_request(&req, token, method, NULL, 0, arg_size, args);
   va_end(args);
 
   if (error != 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
     return error;
   }
 
-  struct msghdr msg;
-  memset(&msg, 0, sizeof(struct msghdr));
+  return vtfs_http_send(pool, &req, response_buffer, buffer_size,
+                        response_length, jiffies + VTFS_HTTP_TIMEOUT);
+}
+
+int64_t vtfs_http_post(struct vtfs_http_pool *pool, const char *token,
+                       const char *method, const void *body, size_t body_len,
+                       char *response_buffer, size_t buffer_size,
+                       size_t arg_size, ...) {
+  struct http_request req;
+  va_list args;
+  va_start(args, arg_size);
+  int64_t error = fill_request(&req, token, method, body ? body : "",
+                               body_len, arg_size, args);
+  va_end(args);
+
+  if (error != 0) {
+    return error;
+  }
 
-  error = kernel_sendmsg(sock, &msg, &kvec, 1, kvec.iov_len);
-  kfree(kvec.iov_base);
+  return vtfs_http_send(pool, &req, response_buffer, buffer_size, NULL,
+                        jiffies + VTFS_HTTP_TIMEOUT);
+}
 
-  if (error < 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
-    return -3;
+struct vtfs_http_async {
+  struct work_struct work;
+  struct vtfs_http_pool *pool;
+  struct http_request req;
+  char *response_buffer;
+  size_t buffer_size;
+  unsigned long deadline; // jiffies
+  vtfs_http_done_t done;
+  void *ctx;
+};
+
+static void vtfs_http_async_work(struct work_struct *work) {
+  struct vtfs_http_async *async =
+      container_of(work, struct vtfs_http_async, work);
+  struct vtfs_http_pool *pool = async->pool;
+  size_t length = 0;
+  int64_t result;
+
+  if (time_left(async->deadline) == 0) {
+    request_free(&async->req);
+    result = -ETIMEDOUT; // expired while queued
+  } else {
+    result = vtfs_http_send(pool, &async->req, async->response_buffer,
+                            async->buffer_size, &length, async->deadline);
   }
 
-  size_t raw_buffer_size = buffer_size + 1024; // add 1KB for HTTP headers
-  char *raw_response_buffer = kmalloc(raw_buffer_size, GFP_KERNEL);
-  if (raw_response_buffer == 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
+  async->done(async->ctx, result, length);
+  kfree(async);
+
+  atomic_dec(&pool->queued);
+  wake_up(&pool->wait);
+}
+
+// Takes a queue slot, waiting for one unless nowait is set, and queues the call
+static int vtfs_http_vsubmit(struct vtfs_http_pool *pool, const char *token,
+                             const char *method, const void *body,
+                             size_t body_len, char *response_buffer,
+                             size_t buffer_size, unsigned long timeout,
+                             vtfs_http_done_t done, void *ctx, bool nowait,
+                             size_t arg_size, va_list args) {
+  int error = 0;
+  if (nowait) {
+    if (!atomic_add_unless(&pool->queued, 1, VTFS_HTTP_QUEUE_MAX)) {
+      return -EBUSY;
+    }
+  } else {
+    error = wait_event_killable(
+        pool->wait,
+        atomic_add_unless(&pool->queued, 1, VTFS_HTTP_QUEUE_MAX));
+  }
+  if (error != 0) {
+    return error;
+  }
+
+  struct vtfs_http_async *async = kmalloc(sizeof(*async), GFP_KERNEL);
+  if (async == 0) {
+    error = -ENOMEM;
+    goto out_release;
+  }
+
+  error = fill_request(&async->req, token, method, body, body_len, arg_size,
+                       args);
+  if (error != 0) {
+    kfree(async);
+    goto out_release;
+  }
+
+  INIT_WORK(&async->work, vtfs_http_async_work);
+  async->pool = pool;
+  async->response_buffer = response_buffer;
+  async->buffer_size = buffer_size;
+  async->deadline = jiffies + timeout;
+  async->done = done;
+  async->ctx = ctx;
+
+  queue_work(pool->wq, &async->work);
+  return 0;
+
+out_release:
+  atomic_dec(&pool->queued);
+  wake_up(&pool->wait);
+  return error;
+}
+
+int vtfs_http_submit(struct vtfs_http_pool *pool, const char *token,
+                     const char *method, const void *body, size_t body_len,
+                     char *response_buffer, size_t buffer_size,
+                     unsigned long timeout, vtfs_http_done_t done, void *ctx,
+                     size_t arg_size, ...) {
+  va_list args;
+  va_start(args, arg_size);
+  int error = vtfs_http_vsubmit(pool, token, method, body, body_len,
+                                response_buffer, buffer_size, timeout, done,
+                                ctx, false, arg_size, args);
+  va_end(args);
+  return error;
+}
+
+int vtfs_http_try_submit(struct vtfs_http_pool *pool, const char *token,
+                         const char *method, const void *body,
+                         size_t body_len, char *response_buffer,
+                         size_t buffer_size, unsigned long timeout,
+                         vtfs_http_done_t done, void *ctx, size_t arg_size,
+                         ...) {
+  va_list args;
+  va_start(args, arg_size);
+  int error = vtfs_http_vsubmit(pool, token, method, body, body_len,
+                                response_buffer, buffer_size, timeout, done,
+                                ctx, true, arg_size, args);
+  va_end(args);
+  return error;
+}
+
+int64_t vtfs_http_call_batch(struct vtfs_http_pool *pool, const char *token,
+                             struct vtfs_http_op *ops, size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  if (count > VTFS_HTTP_BATCH_MAX) {
+    return -E2BIG;
+  }
+
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    size += 2 * sizeof(int64_t) + ops[i].buffer_size;
+  }
+
+  char *response = kvmalloc(size, GFP_KERNEL);
+  if (response == 0) {
     return -ENOMEM;
   }
-  int read_bytes = receive_all(sock, raw_response_buffer, raw_buffer_size);
 
-  kernel_sock_shutdown(sock, SHUT_RDWR);
-  sock_release(sock);
+  struct http_request req;
+  int64_t error = fill_batch_request(&req, token, ops, count);
+  if (error != 0) {
+    kvfree(response);
+    return error;
+  }
 
-  if (read_bytes < 0) {
-    kfree(raw_response_buffer);
-    return -4;
+  size_t length = 0;
+  error = vtfs_http_send(pool, &req, response, size, &length,
+                         jiffies + VTFS_HTTP_TIMEOUT);
+  if (error != 0) {
+    kvfree(response);
+    return error;
   }
 
-  error = parse_http_response(raw_response_buffer, read_bytes, response_buffer,
-                              buffer_size);
+  // Split the records back out to their operations
+  char *record = response;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t data_length;
+
+    if (record + 2 * sizeof(int64_t) > response + length) {
+      error = -6;
+      break;
+    }
+    memcpy(&ops[i].result, record, sizeof(int64_t));
+    memcpy(&data_length, record + sizeof(int64_t), sizeof(uint64_t));
+    record += 2 * sizeof(int64_t);
+
+    if (data_length > response + length - record ||
+        data_length > ops[i].buffer_size) {
+      error = -6;
+      break;
+    }
+    memcpy(ops[i].response_buffer, record, data_length);
+    ops[i].response_length = data_length;
+    record += data_length;
+  }
 
-  kfree(raw_response_buffer);
+  kvfree(response);
   return error;
 }
 
 void encode(const char *src, char *dst) {
   while (*src != '\0') {
-    if ((*src >= '0' && *src <= '9') || (*src >= 'a' && *src <= 'z') ||
-        (*src >= 'A' && *src <= 'Z')) {
-      *dst = *src;
-      dst++;
+    unsigned char c = *src;
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z')) {
+      *dst++ = c;
     } else {
-      sprintf(dst, "%%%02X", (unsigned char)*src);
-      dst += 3;
+      *dst++ = '%';
+      *dst++ = hex_asc_upper_hi(c);
+      *dst++ = hex_asc_upper_lo(c);
     }
     src++;
   }
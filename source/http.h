@@ -2,10 +2,98 @@
 #define VTFS_HTTP_H
 
 #include <linux/inet.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
-int64_t vtfs_http_call(const char *token, const char *method,
-                            char *response_buffer, size_t buffer_size,
-                            size_t arg_size, ...);
+// Workers running asynchronous requests of a pool at once
+#define VTFS_HTTP_WORKERS 8
+// Idle keep-alive connections kept per pool, busier callers open extra ones
+#define VTFS_HTTP_POOL_SIZE VTFS_HTTP_WORKERS
+// Idle connections older than this are closed instead of reused
+#define VTFS_HTTP_IDLE_TIMEOUT (30 * HZ)
+// Asynchronous requests a pool accepts before submitters have to wait
+#define VTFS_HTTP_QUEUE_MAX 256
+// Time a synchronous call may take, from connecting to the end of the response
+#define VTFS_HTTP_TIMEOUT (30 * HZ)
+
+// Most operations vtfs_http_call_batch sends in one request
+#define VTFS_HTTP_BATCH_MAX 64
+
+struct vtfs_http_pool {
+  struct mutex lock;       // protects idle and idle_count
+  struct list_head idle;   // vtfs_http_conn, most recently used first
+  unsigned int idle_count;
+
+  struct workqueue_struct *wq; // runs asynchronous requests
+  atomic_t queued;             // asynchronous requests not completed yet
+  wait_queue_head_t wait;      // for a queue slot, or for queued to drop
+};
+
+int vtfs_http_pool_init(struct vtfs_http_pool *pool);
+// Waits for queued asynchronous requests, then closes every connection
+void vtfs_http_pool_destroy(struct vtfs_http_pool *pool);
+// Waits until every asynchronous request submitted so far has completed
+void vtfs_http_pool_drain(struct vtfs_http_pool *pool);
+
+// Returns the int64 result the backend answered with. Whatever followed it
+// goes to response_buffer, and its length to *response_length unless NULL.
+int64_t vtfs_http_call(struct vtfs_http_pool *pool, const char *token,
+                       const char *method, char *response_buffer,
+                       size_t buffer_size, size_t *response_length,
+                       size_t arg_size, ...);
+
+// As vtfs_http_call, but POSTs body_len bytes from body unencoded as an
+// application/octet-stream body, e.g. file contents for writes
+int64_t vtfs_http_post(struct vtfs_http_pool *pool, const char *token,
+                       const char *method, const void *body, size_t body_len,
+                       char *response_buffer, size_t buffer_size,
+                       size_t arg_size, ...);
+
+// One operation of a batch, arguments as for vtfs_http_call, body as for
+// vtfs_http_post
+struct vtfs_http_op {
+  const char *method;
+  const char *const *args; // arg_size name/value pairs
+  size_t arg_size;
+  const void *body;        // NULL if the operation has none
+  size_t body_len;
+  char *response_buffer;   // may be NULL when buffer_size is 0
+  size_t buffer_size;
+  int64_t result;          // set by vtfs_http_call_batch
+  size_t response_length;  // set by vtfs_http_call_batch
+};
+
+// Runs count operations in one round trip through /api/batch. Returns 0 once
+// the batch went through, each operation's own outcome is in its result.
+int64_t vtfs_http_call_batch(struct vtfs_http_pool *pool, const char *token,
+                             struct vtfs_http_op *ops, size_t count);
+
+// Completion of an asynchronous request, with what vtfs_http_call would have
+// returned and the length of the response. Runs in a pool worker.
+typedef void (*vtfs_http_done_t)(void *ctx, int64_t result,
+                                 size_t response_length);
+
+// Queues a call to method and returns without waiting for it. Arguments are
+// copied, body (may be NULL for a GET) and response_buffer must stay valid
+// until done runs. timeout bounds the whole call, including the time spent
+// queued, and done gets -ETIMEDOUT once it runs out. Waits for a slot while
+// VTFS_HTTP_QUEUE_MAX requests are pending.
+int vtfs_http_submit(struct vtfs_http_pool *pool, const char *token,
+                     const char *method, const void *body, size_t body_len,
+                     char *response_buffer, size_t buffer_size,
+                     unsigned long timeout, vtfs_http_done_t done, void *ctx,
+                     size_t arg_size, ...);
+
+// As vtfs_http_submit, but fails with -EBUSY instead of waiting when the queue
+// is full. Safe to call with locks held that pool workers may need.
+int vtfs_http_try_submit(struct vtfs_http_pool *pool, const char *token,
+                         const char *method, const void *body,
+                         size_t body_len, char *response_buffer,
+                         size_t buffer_size, unsigned long timeout,
+                         vtfs_http_done_t done, void *ctx, size_t arg_size,
+                         ...);
 
 void encode(const char *, char *);
 
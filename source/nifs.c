@@ -1,14 +1,28 @@
 #include "nifs.h"
 
+#include <linux/bvec.h>
+#include <linux/falloc.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/parser.h>
 #include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/writeback.h>
 
 #include "nifs_utils.h"
 
 // ====== CREATED FILES TRACKING ======
 
-LIST_HEAD(nifs_directories);
-LIST_HEAD(nifs_files);
-int nifs_next_inode = NIFS_NEXT_INODE;
+static ulong nifs_alloc_inode_number(struct nifs_sb_info* sbi) {
+  ulong ino = atomic_long_fetch_inc(&sbi->next_inode);
+  if (ino == NIFS_ROOT_INODE) {
+    ino = atomic_long_fetch_inc(&sbi->next_inode);  // Root inode number is taken at mount time
+  }
+  return ino;
+}
 
 // ====== ====================== ======
 
@@ -16,19 +30,82 @@ static struct dentry* nifs_lookup(
     struct inode* parent_inode, struct dentry* child_dentry, unsigned int flag
 );
 
-static struct nifs_file_data* nifs_alloc_file_data(void);
+static struct nifs_file_data* nifs_alloc_file_data(struct nifs_sb_info* sbi);
 
 static void nifs_free_file_data(struct nifs_file_data* fd);
 
+static struct nifs_file_data* nifs_get_file_data(struct nifs_file_data* fd);
+
+static void nifs_put_file_data(struct nifs_file_data* fd);
+
+static struct nifs_dirty_range* nifs_writeback_range_alloc(struct nifs_file_data* fd);
+
+static void nifs_writeback_mark(
+    struct nifs_file_data* fd,
+    struct nifs_dirty_range* range,
+    loff_t start,
+    loff_t end,
+    bool resized
+);
+
+static void nifs_writeback_grow(struct nifs_file_data* fd, loff_t new_size);
+
+static void nifs_writeback_discard(struct nifs_file_data* fd);
+
 static int nifs_create(struct mnt_idmap*, struct inode*, struct dentry*, umode_t, bool);
 
 static int nifs_unlink(struct inode* parent_inode, struct dentry* child_dentry);
 
 static int nifs_iterate(struct file* filp, struct dir_context* ctx);
 
-static ssize_t nifs_read(struct file* filp, char __user* buffer, size_t len, loff_t* offset);
+static int nifs_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* iattr);
+
+static int nifs_getattr(
+    struct mnt_idmap* idmap,
+    const struct path* path,
+    struct kstat* stat,
+    u32 request_mask,
+    unsigned int query_flags
+);
+
+static loff_t nifs_llseek(struct file* filp, loff_t offset, int whence);
+
+static long nifs_fallocate(struct file* filp, int mode, loff_t offset, loff_t len);
+
+static int nifs_fsync(struct file* filp, loff_t start, loff_t end, int datasync);
+
+static int nifs_flush(struct file* filp, fl_owner_t id);
 
-static ssize_t nifs_write(struct file* filp, const char __user* buffer, size_t len, loff_t* offset);
+static int nifs_open(struct inode* inode, struct file* filp);
+
+static int nifs_file_mmap(struct file* filp, struct vm_area_struct* vma);
+
+static ssize_t nifs_file_read_iter(struct kiocb* iocb, struct iov_iter* to);
+
+static ssize_t nifs_file_write_iter(struct kiocb* iocb, struct iov_iter* from);
+
+static int nifs_read_folio(struct file* filp, struct folio* folio);
+
+static int nifs_write_begin(
+    struct file* filp,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    struct folio** foliop,
+    void** fsdata
+);
+
+static int nifs_write_end(
+    struct file* filp,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    unsigned int copied,
+    struct folio* folio,
+    void* fsdata
+);
+
+static int nifs_writepages(struct address_space* mapping, struct writeback_control* wbc);
 
 static struct dentry* nifs_mkdir(
     struct mnt_idmap* idmap, struct inode* parent_inode, struct dentry* child_dentry, umode_t mode
@@ -49,31 +126,105 @@ struct inode_operations nifs_inode_ops = {
     .mkdir = nifs_mkdir,
     .rmdir = nifs_rmdir,
     .link = nifs_link,
+    .setattr = nifs_setattr,
+    .getattr = nifs_getattr,
 };
 #pragma clang diagnostic pop
 
 static const struct file_operations nifs_dir_operations = {
     .owner = THIS_MODULE,
+    .llseek = generic_file_llseek,
+    .read = generic_read_dir,
     .iterate_shared = nifs_iterate,
 };
 
 static const struct file_operations nifs_file_operations = {
     .owner = THIS_MODULE,
-    .read = nifs_read,
-    .write = nifs_write,
-    .llseek = generic_file_llseek,
-    .open = simple_open,
+    .read_iter = nifs_file_read_iter,
+    .write_iter = nifs_file_write_iter,
+    .splice_read = filemap_splice_read,
+    .splice_write = iter_file_splice_write,
+    .mmap = nifs_file_mmap,
+    .fsync = nifs_fsync,
+    .flush = nifs_flush,
+    .llseek = nifs_llseek,
+    .fallocate = nifs_fallocate,
+    .open = nifs_open,
+};
+
+// Page cache on top of nifs_file_data: writes go through to the file data, only
+// folios dirtied through shared mappings are written back later
+static const struct address_space_operations nifs_aops = {
+    .read_folio = nifs_read_folio,
+    .write_begin = nifs_write_begin,
+    .write_end = nifs_write_end,
+    .dirty_folio = filemap_dirty_folio,
+    .writepages = nifs_writepages,
 };
 
+static void nifs_attrs_save(struct nifs_attrs* attrs, struct inode* inode) {
+  attrs->mode = inode->i_mode;
+  attrs->uid = inode->i_uid;
+  attrs->gid = inode->i_gid;
+  attrs->atime = inode_get_atime(inode);
+  attrs->mtime = inode_get_mtime(inode);
+  attrs->ctime = inode_get_ctime(inode);
+}
+
+// Sets up a fresh inode from what was saved when it was last evicted, or as
+// new if it never was
+static void nifs_attrs_load(struct nifs_attrs* attrs, struct inode* inode) {
+  if (!attrs->mode) {
+    simple_inode_init_ts(inode);
+    return;
+  }
+
+  inode->i_mode = attrs->mode;
+  inode->i_uid = attrs->uid;
+  inode->i_gid = attrs->gid;
+  inode_set_atime_to_ts(inode, attrs->atime);
+  inode_set_mtime_to_ts(inode, attrs->mtime);
+  inode_set_ctime_to_ts(inode, attrs->ctime);
+}
+
+// Directory size and link count follow its index: every child adds
+// NIFS_DIRENT_SIZE bytes, and every subdirectory a link for its ".."
+static void nifs_dir_counts(struct nifs_dir_entry* dir, loff_t* size, unsigned int* nlink) {
+  unsigned int subdirs = atomic_read(&dir->subdirs_index.nelems);
+  unsigned int files = atomic_read(&dir->files_index.nelems);
+
+  *size = (loff_t)(subdirs + files) * NIFS_DIRENT_SIZE;
+  *nlink = 2 + subdirs;
+}
+
+// Called with the directory inode locked, after a child was added or removed
+static void nifs_dir_changed(struct inode* inode, struct nifs_dir_entry* dir) {
+  loff_t size;
+  unsigned int nlink;
+
+  nifs_dir_counts(dir, &size, &nlink);
+  i_size_write(inode, size);
+  set_nlink(inode, nlink);
+  inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+}
+
+// Returns the in-core inode for i_ino, setting it up from mode and data if it
+// isn't cached yet. Regular files get a reference to their data in i_private,
+// dropped on eviction.
 static struct inode* nifs_get_inode(
-    struct super_block* sb, const struct inode* dir, umode_t mode, ulong i_ino
+    struct super_block* sb,
+    const struct inode* dir,
+    umode_t mode,
+    ulong i_ino,
+    struct nifs_file_data* data
 ) {
-  struct inode* inode = new_inode(sb);
+  struct inode* inode = iget_locked(sb, i_ino);
   if (!inode) {
     return NULL;
   }
-
-  inode->i_ino = i_ino;
+  if (!(inode->i_state & I_NEW)) {
+    return inode;  // Another link or an earlier lookup already brought it in
+  }
 
   inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
 
@@ -81,15 +232,199 @@ static struct inode* nifs_get_inode(
     inode->i_op = &nifs_inode_ops;
     inode->i_fop = &nifs_dir_operations;
     set_nlink(inode, 2);
+
+    // Not indexed yet when called from nifs_mkdir
+    rcu_read_lock();
+    struct nifs_dir_entry* dir_entry = nifs_find_directory(NIFS_SB(sb), i_ino);
+    if (dir_entry) {
+      loff_t size;
+      unsigned int nlink;
+      nifs_dir_counts(dir_entry, &size, &nlink);
+      i_size_write(inode, size);
+      set_nlink(inode, nlink);
+      nifs_attrs_load(&dir_entry->attrs, inode);
+    } else {
+      simple_inode_init_ts(inode);
+    }
+    rcu_read_unlock();
   } else if (S_ISREG(mode)) {
     inode->i_op = &nifs_inode_ops;
     inode->i_fop = &nifs_file_operations;
-    set_nlink(inode, 1);
+    inode->i_mapping->a_ops = &nifs_aops;
+    inode->i_private = nifs_get_file_data(data);
+    down_read(&data->lock);
+    i_size_write(inode, data->size);
+    set_nlink(inode, data->nlink);
+    nifs_attrs_load(&data->attrs, inode);
+    up_read(&data->lock);
   }
 
+  unlock_new_inode(inode);
   return inode;
 }
 
+// The store keeps the attributes of a still linked inode for the next nifs_get_inode
+static void nifs_evict_inode(struct inode* inode) {
+  truncate_inode_pages_final(&inode->i_data);
+  clear_inode(inode);
+  if (inode->i_private) {
+    struct nifs_file_data* data = inode->i_private;
+    down_write(&data->lock);
+    nifs_attrs_save(&data->attrs, inode);
+    up_write(&data->lock);
+    nifs_put_file_data(data);
+    inode->i_private = NULL;
+  } else if (S_ISDIR(inode->i_mode)) {
+    rcu_read_lock();
+    struct nifs_dir_entry* dir = nifs_find_directory(NIFS_SB(inode->i_sb), inode->i_ino);
+    if (dir) {
+      nifs_attrs_save(&dir->attrs, inode);
+    }
+    rcu_read_unlock();
+  }
+}
+
+// Page cache pages over files of sb. Those are copies of stored pages the
+// kernel reclaims on its own, see the FILE OPERATIONS section.
+static unsigned long nifs_count_cached_pages(struct super_block* sb) {
+  unsigned long pages = 0;
+  struct inode* inode;
+
+  spin_lock(&sb->s_inode_list_lock);
+  list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+    pages += READ_ONCE(inode->i_mapping->nrpages);
+  }
+  spin_unlock(&sb->s_inode_list_lock);
+  return pages;
+}
+
+static int nifs_show_stats(struct seq_file* m, struct dentry* root) {
+  struct nifs_sb_info* sbi = NIFS_SB(root->d_sb);
+  long allocated = atomic_long_read(&sbi->stats.pages_allocated);
+  long freed = atomic_long_read(&sbi->stats.pages_freed);
+
+  seq_printf(
+      m,
+      "pages_allocated=%ld pages_freed=%ld pages_in_use=%ld pages_fetched=%ld pages_evicted=%ld "
+      "writes=%ld pagecache_pages=%lu",
+      allocated,
+      freed,
+      allocated - freed,
+      atomic_long_read(&sbi->stats.pages_fetched),
+      atomic_long_read(&sbi->stats.pages_evicted),
+      atomic_long_read(&sbi->stats.writes),
+      nifs_count_cached_pages(root->d_sb)
+  );
+  return 0;
+}
+
+static int nifs_show_options(struct seq_file* m, struct dentry* root) {
+  struct nifs_sb_info* sbi = NIFS_SB(root->d_sb);
+
+  if (sbi->writeback) {
+    seq_puts(m, ",writeback");
+  }
+  if (sbi->dirty_expire != NIFS_DIRTY_EXPIRE) {
+    seq_printf(m, ",dirty_expire_ms=%u", jiffies_to_msecs(sbi->dirty_expire));
+  }
+  if (sbi->dirty_limit != NIFS_DIRTY_BYTES) {
+    seq_printf(m, ",dirty_bytes=%zu", sbi->dirty_limit);
+  }
+  if (sbi->cache_limit) {
+    seq_printf(m, ",cache_bytes=%zu", sbi->cache_limit);
+  }
+  if (sbi->attr_timeout != NIFS_ATTR_TIMEOUT) {
+    seq_printf(m, ",attr_timeout_ms=%u", jiffies_to_msecs(sbi->attr_timeout));
+  }
+  if (sbi->neg_timeout != NIFS_NEG_TIMEOUT) {
+    seq_printf(m, ",neg_timeout_ms=%u", jiffies_to_msecs(sbi->neg_timeout));
+  }
+  if (sbi->readdirplus) {
+    seq_puts(m, ",readdirplus");
+  }
+  return 0;
+}
+
+static const struct super_operations nifs_super_ops = {
+    .statfs = simple_statfs,
+    .evict_inode = nifs_evict_inode,
+    .show_options = nifs_show_options,
+    .show_stats = nifs_show_stats,
+};
+
+// ====== ENTRY ALLOCATION ======
+
+static struct kmem_cache* nifs_file_entry_cache;
+static struct kmem_cache* nifs_dir_entry_cache;
+static struct kmem_cache* nifs_file_data_cache;
+static struct workqueue_struct* nifs_free_wq;  // Frees directory entries, see nifs_free_dir_entry
+
+static struct nifs_file_entry* nifs_alloc_file_entry(const char* name) {
+  struct nifs_file_entry* file = kmem_cache_alloc(nifs_file_entry_cache, GFP_KERNEL);
+  if (!file) {
+    return NULL;
+  }
+
+  if (nifs_init_name(&file->name, file->inline_name, name)) {
+    kmem_cache_free(nifs_file_entry_cache, file);
+    return NULL;
+  }
+  file->name_hash = nifs_name_hash(name);
+  return file;
+}
+
+static void nifs_free_file_entry_rcu(struct rcu_head* head) {
+  struct nifs_file_entry* file = container_of(head, struct nifs_file_entry, rcu);
+  nifs_free_name(file->name, file->inline_name);
+  kmem_cache_free(nifs_file_entry_cache, file);
+}
+
+// Lockless lookups and readdir may still see the entry until a grace period passes
+static void nifs_free_file_entry(struct nifs_file_entry* file) {
+  call_rcu(&file->rcu, nifs_free_file_entry_rcu);
+}
+
+static struct nifs_dir_entry* nifs_alloc_dir_entry(const char* name) {
+  struct nifs_dir_entry* dir = kmem_cache_alloc(nifs_dir_entry_cache, GFP_KERNEL);
+  if (!dir) {
+    return NULL;
+  }
+
+  if (nifs_init_name(&dir->name, dir->inline_name, name)) {
+    kmem_cache_free(nifs_dir_entry_cache, dir);
+    return NULL;
+  }
+
+  if (nifs_init_dir_index(dir)) {
+    nifs_free_name(dir->name, dir->inline_name);
+    kmem_cache_free(nifs_dir_entry_cache, dir);
+    return NULL;
+  }
+
+  dir->name_hash = nifs_name_hash(name);
+  init_rwsem(&dir->lock);
+  dir->attrs.mode = 0;
+  return dir;
+}
+
+static void nifs_free_dir_entry_work(struct work_struct* work) {
+  struct nifs_dir_entry* dir =
+      container_of(to_rcu_work(work), struct nifs_dir_entry, free_work);
+  nifs_destroy_dir_index(dir);
+  nifs_free_name(dir->name, dir->inline_name);
+  kmem_cache_free(nifs_dir_entry_cache, dir);
+}
+
+// nifs_d_revalidate searches a directory's index without the VFS locking it,
+// so the index has to outlive lockless readers too. rhashtable_destroy may
+// sleep, hence a workqueue instead of call_rcu.
+static void nifs_free_dir_entry(struct nifs_dir_entry* dir) {
+  INIT_RCU_WORK(&dir->free_work, nifs_free_dir_entry_work);
+  queue_rcu_work(nifs_free_wq, &dir->free_work);
+}
+
+// ====== ================ ======
+
 // ====== FILE MANAGEMENT ======
 
 static int nifs_create(
@@ -100,110 +435,118 @@ static int nifs_create(
     bool b
 ) {
   const char* name = child_dentry->d_name.name;
-  struct nifs_dir_entry* parent_dir = nifs_find_directory(parent_inode->i_ino);
+  struct nifs_sb_info* sbi = NIFS_SB(parent_inode->i_sb);
+  struct nifs_dir_entry* parent_dir = nifs_find_directory(sbi, parent_inode->i_ino);
+  int ret;
 
   if (!parent_dir) {
     return -ENOENT;  // Parent directory does not exist...
   }
 
-  if (nifs_find_file_in_dir(parent_dir, name)) {
-    return -EEXIST;  // File already exists!
-  }
-
-  if (nifs_find_subdir(parent_dir, name)) {
-    return -EEXIST;  // Directory already exists!
-  }
-
-  struct nifs_file_entry* new_entry = kmalloc(sizeof(struct nifs_file_entry), GFP_KERNEL);
+  // Everything that may sleep for long is set up before taking the directory lock
+  struct nifs_file_entry* new_entry = nifs_alloc_file_entry(name);
   if (!new_entry) {
     return -ENOMEM;
   }
 
-  new_entry->name = kmalloc(strlen(name) + 1, GFP_KERNEL);
-  new_entry->data = nifs_alloc_file_data();
-  if (!new_entry->name || !new_entry->data) {
-    nifs_free_file_data(new_entry->data);
-    kfree(new_entry->name);
-    kfree(new_entry);
+  new_entry->data = nifs_alloc_file_data(sbi);
+  if (!new_entry->data) {
+    nifs_free_file_entry(new_entry);
     return -ENOMEM;
   }
-  strcpy(new_entry->name, name);
 
-  new_entry->inode_number = nifs_next_inode++;
+  new_entry->inode_number = nifs_alloc_inode_number(sbi);
   new_entry->parent_inode = parent_inode->i_ino;
-  INIT_LIST_HEAD(&new_entry->parent_list);
-  INIT_LIST_HEAD(&new_entry->global_list);
-
-  list_add_tail(&new_entry->parent_list, &parent_dir->files);
-  list_add_tail(&new_entry->global_list, &nifs_files);
+  new_entry->data->inode_number = new_entry->inode_number;
 
   struct inode* inode = nifs_get_inode(
-      parent_inode->i_sb, parent_inode, S_IFREG | (mode & ~S_IFMT), new_entry->inode_number
+      parent_inode->i_sb,
+      parent_inode,
+      S_IFREG | (mode & ~S_IFMT),
+      new_entry->inode_number,
+      new_entry->data
   );
   if (!inode) {
-    list_del(&new_entry->parent_list);
-    list_del(&new_entry->global_list);
-    nifs_free_file_data(new_entry->data);
-    kfree(new_entry->name);
-    kfree(new_entry);
-    return -ENOMEM;
+    ret = -ENOMEM;
+    goto out_free;
   }
 
-  if (S_ISREG(mode)) {
-    set_nlink(inode, 1);
+  ret = nifs_index_file_data(sbi, new_entry->inode_number, new_entry->data);
+  if (ret) {
+    goto out_iput;
   }
 
-  inode->i_op = &nifs_inode_ops;
-  inode->i_fop = &nifs_file_operations;
+  down_write(&parent_dir->lock);
+  if (nifs_find_file_in_dir(parent_dir, name) || nifs_find_subdir(parent_dir, name)) {
+    ret = -EEXIST;  // File or directory already exists!
+  } else {
+    ret = nifs_dir_add_file(parent_dir, new_entry);
+  }
+  up_write(&parent_dir->lock);
+  if (ret) {
+    goto out_unindex;
+  }
 
+  nifs_dir_changed(parent_inode, parent_dir);
+  child_dentry->d_time = jiffies;
   d_add(child_dentry, inode);
   LOG("Created file: %s (inode %lu) in directory %lu\n",
       name,
       new_entry->inode_number,
       parent_inode->i_ino);
   return 0;
+
+out_unindex:
+  nifs_unindex_inode(sbi, new_entry->inode_number);
+out_iput:
+  clear_nlink(inode);  // Not cached past this iput
+  iput(inode);
+out_free:
+  nifs_put_file_data(new_entry->data);
+  nifs_free_file_entry(new_entry);
+  return ret;
 }
 
 static int nifs_unlink(struct inode* parent_inode, struct dentry* child_dentry) {
   const char* name = child_dentry->d_name.name;
-  struct nifs_dir_entry* parent_dir = nifs_find_directory(parent_inode->i_ino);
+  struct nifs_sb_info* sbi = NIFS_SB(parent_inode->i_sb);
+  struct nifs_dir_entry* parent_dir = nifs_find_directory(sbi, parent_inode->i_ino);
   struct inode* target_inode = d_inode(child_dentry);
 
   if (!parent_dir) {
     return -ENOENT;
   }
 
+  down_write(&parent_dir->lock);
   struct nifs_file_entry* file = nifs_find_file_in_dir(parent_dir, name);
   if (!file) {
+    up_write(&parent_dir->lock);
     return -ENOENT;
   }
+  nifs_dir_remove_file(parent_dir, file);
+  up_write(&parent_dir->lock);
 
   LOG("Removing file: %s (inode %lu, current links: %u)\n",
       name,
       file->inode_number,
       target_inode->i_nlink);
 
-  list_del(&file->parent_list);
-  list_del(&file->global_list);
-
-  int remaining_entries = 0;
-  struct nifs_file_entry* entry;
-  list_for_each_entry(entry, &nifs_files, global_list) {
-    if (entry->inode_number == file->inode_number) {
-      remaining_entries++;
-    }
-  }
+  struct nifs_file_data* data = file->data;
+  down_write(&data->lock);
+  bool last_link = --data->nlink == 0;
+  up_write(&data->lock);
 
-  LOG("Remaining entries for inode %lu: %d\n", file->inode_number, remaining_entries);
-
-  if (remaining_entries == 0) {
-    nifs_free_file_data(file->data);
-    LOG("Freed file data for inode %lu\n", file->inode_number);
+  if (last_link) {
+    nifs_unindex_inode(sbi, file->inode_number);
+    nifs_writeback_discard(data);  // The backend will never be asked for it again
+    LOG("Last link to inode %lu removed\n", file->inode_number);
   }
+  nifs_put_file_data(data);
 
-  kfree(file->name);
-  kfree(file);
+  nifs_free_file_entry(file);
 
+  nifs_dir_changed(parent_inode, parent_dir);
+  inode_set_ctime_current(target_inode);
   drop_nlink(target_inode);
 
   return 0;
@@ -218,356 +561,2414 @@ static struct dentry* nifs_mkdir(
 ) {
   LOG("MKDIR!");
   const char* name = child_dentry->d_name.name;
-  struct nifs_dir_entry* parent_dir = nifs_find_directory(parent_inode->i_ino);
+  struct nifs_sb_info* sbi = NIFS_SB(parent_inode->i_sb);
+  struct nifs_dir_entry* parent_dir = nifs_find_directory(sbi, parent_inode->i_ino);
+  int ret;
 
   if (!parent_dir) {
     return ERR_PTR(-ENOENT);  // Parent directory does not exist...
   }
 
-  if (nifs_find_file_in_dir(parent_dir, name)) {
-    return ERR_PTR(-EEXIST);  // File already exists!
-  }
-
-  if (nifs_find_subdir(parent_dir, name)) {
-    return ERR_PTR(-EEXIST);  // Directory already exists!
-  }
-
-  struct nifs_dir_entry* new_dir = kmalloc(sizeof(struct nifs_dir_entry), GFP_KERNEL);
+  struct nifs_dir_entry* new_dir = nifs_alloc_dir_entry(name);
   if (!new_dir) {
     return ERR_PTR(-ENOMEM);
   }
 
-  new_dir->name = kmalloc(strlen(name) + 1, GFP_KERNEL);
-  if (!new_dir->name) {
-    kfree(new_dir);
-    return ERR_PTR(-ENOMEM);
-  }
-  strcpy(new_dir->name, name);
-
-  new_dir->inode_number = nifs_next_inode++;
+  new_dir->inode_number = nifs_alloc_inode_number(sbi);
   new_dir->parent_inode = parent_inode->i_ino;
-  INIT_LIST_HEAD(&new_dir->files);
-  INIT_LIST_HEAD(&new_dir->subdirs);
-  INIT_LIST_HEAD(&new_dir->parent_list);
-  INIT_LIST_HEAD(&new_dir->global_list);
-
-  list_add_tail(&new_dir->parent_list, &parent_dir->subdirs);
-  list_add_tail(&new_dir->global_list, &nifs_directories);
 
   struct inode* inode = nifs_get_inode(
-      parent_inode->i_sb, parent_inode, S_IFDIR | (mode & ~S_IFMT), new_dir->inode_number
+      parent_inode->i_sb, parent_inode, S_IFDIR | (mode & ~S_IFMT), new_dir->inode_number, NULL
   );
   if (!inode) {
-    list_del(&new_dir->parent_list);
-    list_del(&new_dir->global_list);
-    kfree(new_dir->name);
-    kfree(new_dir);
-    return ERR_PTR(-ENOMEM);
+    ret = -ENOMEM;
+    goto out_free;
+  }
+
+  ret = nifs_index_directory(sbi, new_dir);
+  if (ret) {
+    goto out_iput;
   }
 
-  inode->i_op = &nifs_inode_ops;
-  inode->i_fop = &nifs_dir_operations;
+  down_write(&parent_dir->lock);
+  if (nifs_find_file_in_dir(parent_dir, name) || nifs_find_subdir(parent_dir, name)) {
+    ret = -EEXIST;  // File or directory already exists!
+  } else {
+    ret = nifs_dir_add_subdir(parent_dir, new_dir);
+  }
+  up_write(&parent_dir->lock);
+  if (ret) {
+    goto out_unindex;
+  }
 
+  nifs_dir_changed(parent_inode, parent_dir);
+  child_dentry->d_time = jiffies;
   d_add(child_dentry, inode);
   LOG("Created directory: %s (inode %lu) in parent %lu\n",
       name,
       new_dir->inode_number,
       parent_inode->i_ino);
 
-  return child_dentry;
+  return NULL;  // child_dentry was used as is
+
+out_unindex:
+  nifs_unindex_inode(sbi, new_dir->inode_number);
+out_iput:
+  clear_nlink(inode);
+  iput(inode);
+out_free:
+  nifs_free_dir_entry(new_dir);
+  return ERR_PTR(ret);
 }
 
 static int nifs_rmdir(struct inode* parent_inode, struct dentry* child_dentry) {
   const char* name = child_dentry->d_name.name;
-  struct nifs_dir_entry* parent_dir = nifs_find_directory(parent_inode->i_ino);
+  struct nifs_sb_info* sbi = NIFS_SB(parent_inode->i_sb);
+  struct nifs_dir_entry* parent_dir = nifs_find_directory(sbi, parent_inode->i_ino);
 
   if (!parent_dir) {
     return -ENOENT;
   }
 
+  down_write(&parent_dir->lock);
   struct nifs_dir_entry* dir = nifs_find_subdir(parent_dir, name);
   if (!dir) {
+    up_write(&parent_dir->lock);
     return -ENOENT;
   }
 
-  if (!list_empty(&dir->files) || !list_empty(&dir->subdirs)) {
+  // Lock order is always parent before child
+  down_read(&dir->lock);
+  bool empty = xa_empty(&dir->cookies);
+  up_read(&dir->lock);
+
+  if (!empty) {
+    up_write(&parent_dir->lock);
     return -ENOTEMPTY;
   }
 
-  list_del(&dir->parent_list);
-  list_del(&dir->global_list);
+  nifs_dir_remove_subdir(parent_dir, dir);
+  up_write(&parent_dir->lock);
+
+  nifs_unindex_inode(sbi, dir->inode_number);
+
+  nifs_dir_changed(parent_inode, parent_dir);
+  clear_nlink(d_inode(child_dentry));
 
-  kfree(dir->name);
-  kfree(dir);
   LOG("Removed directory: %s\n", name);
+  nifs_free_dir_entry(dir);
   return 0;
 }
 // ====== ============== ======
 
 // ====== FILE DATA MANAGEMENT ======
 
-static struct nifs_file_data* nifs_alloc_file_data(void) {
-  struct nifs_file_data* fd = kmalloc(sizeof(struct nifs_file_data), GFP_KERNEL);
+static struct nifs_file_data* nifs_alloc_file_data(struct nifs_sb_info* sbi) {
+  struct nifs_file_data* fd = kmem_cache_alloc(nifs_file_data_cache, GFP_KERNEL);
   if (!fd) {
     return NULL;
   }
 
+  init_rwsem(&fd->lock);
+  xa_init(&fd->pages);
   fd->size = 0;
-  fd->capacity = 0;
-  fd->data = NULL;
+  fd->nlink = 1;
+  kref_init(&fd->refcount);  // Reference of the first link
+  fd->attrs.mode = 0;
+
+  fd->inode_number = 0;
+  fd->sbi = sbi;
+  INIT_LIST_HEAD(&fd->dirty_ranges);
+  fd->dirty_bytes = 0;
+  fd->size_dirty = false;
+  fd->remote_size = 0;
+  INIT_LIST_HEAD(&fd->dirty_node);
+  mutex_init(&fd->flush_lock);
+
+  fd->ra_next = 0;
+  fd->ra_mark = ULONG_MAX;
+  fd->ra_pages = 0;
+  atomic_set(&fd->ra_inflight, 0);
+  fd->gen = 0;
+
+  INIT_LIST_HEAD(&fd->lru_node);
+  fd->lru_referenced = true;
+  atomic_long_set(&fd->lru_pages, 0);
   return fd;
 }
 
-static int nifs_resize_file_data(struct nifs_file_data* fd, size_t new_size) {
-  if (new_size <= fd->capacity) {
-    fd->size = new_size;
-    return 0;
-  }
-
-  size_t new_capacity = new_size;
-  char* new_data = krealloc(fd->data, new_capacity, GFP_KERNEL);
-  if (!new_data) {
-    return -ENOMEM;
-  }
-
-  fd->data = new_data;
-  fd->capacity = new_capacity;
+static bool nifs_cache_over_limit(struct nifs_sb_info* sbi) {
+  return sbi->cache_limit && atomic_long_read(&sbi->cache_pages) > sbi->cache_limit >> PAGE_SHIFT;
+}
 
-  size_t old_size = fd->size;
-  fd->size = new_size;
+// Puts fd on the LRU while it has pages in memory and takes it off once it has
+// none, so the clock only passes files it could evict from. Only data the
+// backend has a copy of can be evicted, so without write-back there is no LRU.
+// Checks the count under lru_lock, so racing updates settle on the last one.
+static void nifs_file_data_lru_update(struct nifs_file_data* fd) {
+  struct nifs_sb_info* sbi = fd->sbi;
 
-  if (new_size > old_size) {
-    memset(fd->data + old_size, 0, new_size - old_size);
+  if (!sbi->writeback) {
+    return;
   }
 
-  return 0;
-}
-
-static void nifs_free_file_data(struct nifs_file_data* fd) {
-  if (fd) {
-    kfree(fd->data);
-    kfree(fd);
+  spin_lock(&sbi->lru_lock);
+  bool resident = atomic_long_read(&fd->lru_pages) > 0;
+  if (resident && list_empty(&fd->lru_node)) {
+    list_add_tail(&fd->lru_node, &sbi->lru);
+    sbi->lru_files++;
+  } else if (!resident && !list_empty(&fd->lru_node)) {
+    list_del_init(&fd->lru_node);
+    sbi->lru_files--;
   }
+  spin_unlock(&sbi->lru_lock);
 }
 
-// ====== ==================== ======
-
-// ====== FILE OPERATIONS ======
-
-static ssize_t nifs_read(struct file* filp, char __user* buffer, size_t len, loff_t* offset) {
-  struct inode* inode = file_inode(filp);
-  struct nifs_file_entry* entry;
+// Counts pages of fd held in memory against the cache_bytes budget of its
+// mount, and starts reclaim once that is exceeded
+static void nifs_file_data_charge(struct nifs_file_data* fd, long pages) {
+  struct nifs_sb_info* sbi = fd->sbi;
 
-  list_for_each_entry(entry, &nifs_files, global_list) {
-    if (entry->inode_number == inode->i_ino) {
-      if (*offset >= entry->data->size) {
-        return 0;  // EOF
-      }
+  long now = atomic_long_add_return(pages, &fd->lru_pages);
+  if (now == 0 || now == pages) {
+    nifs_file_data_lru_update(fd);
+  }
 
-      size_t to_read = min(len, entry->data->size - *offset);
-      if (copy_to_user(buffer, entry->data->data + *offset, to_read)) {
-        return -EFAULT;
-      }
+  atomic_long_add(pages, &sbi->cache_pages);
+  if (pages > 0 && nifs_cache_over_limit(sbi)) {
+    queue_work(system_unbound_wq, &sbi->reclaim_work);
+  }
+}
 
-      *offset += to_read;
-      return to_read;
+// Stands in for a page whose contents are only on the backend. Such pages are
+// fetched when first needed, unlike holes, which read as zeros.
+#define NIFS_REMOTE_PAGE xa_mk_value(0)
+
+// Frees every page with an index in [first, last]
+static void nifs_file_data_free_pages(struct nifs_file_data* fd, pgoff_t first, pgoff_t last) {
+  struct page* page;
+  ulong index;
+  long freed = 0;
+
+  xa_for_each_range(&fd->pages, index, page, first, last) {
+    xa_erase(&fd->pages, index);
+    if (!xa_is_value(page)) {
+      __free_page(page);
+      freed++;
     }
   }
 
-  return -ENOENT;
+  if (freed) {
+    atomic_long_add(freed, &fd->sbi->stats.pages_freed);
+    nifs_file_data_charge(fd, -freed);
+  }
 }
 
-static ssize_t nifs_write(
-    struct file* filp, const char __user* buffer, size_t len, loff_t* offset
-) {
-  struct inode* inode = file_inode(filp);
-  struct nifs_file_entry* entry;
-  int ret;
-  loff_t pos = *offset;
+// ------ Remote pages ------
 
-  list_for_each_entry(entry, &nifs_files, global_list) {
-    if (entry->inode_number == inode->i_ino) {
-      if (filp->f_flags & O_APPEND) {
-        pos = entry->data->size;
-      }
+// Readahead window bounds, in pages
+#define NIFS_RA_MIN_PAGES 4
+#define NIFS_RA_MAX_PAGES 256
 
-      size_t new_size = pos + len;
+// Turns the remote pages of [index, index + count) into local ones holding
+// len bytes of buffer, zero-filled past them, so the rest of buffer is never
+// read. Only swaps out the stand-in, so a page written, punched or truncated
+// meanwhile is left alone.
+static void nifs_file_data_install(
+    struct nifs_file_data* fd, pgoff_t index, unsigned int count, const char* buffer, size_t len
+) {
+  for (unsigned int i = 0; i < count; i++) {
+    if (xa_load(&fd->pages, index + i) != NIFS_REMOTE_PAGE) {
+      continue;
+    }
 
-      ret = nifs_resize_file_data(entry->data, new_size);
-      if (ret) {
-        return ret;
-      }
+    struct page* page = alloc_page(GFP_HIGHUSER);
+    if (!page) {
+      return;
+    }
 
-      if (copy_from_user(entry->data->data + pos, buffer, len)) {
-        return -EFAULT;
-      }
+    size_t offset = (size_t)i << PAGE_SHIFT;
+    size_t n = offset < len ? min_t(size_t, len - offset, PAGE_SIZE) : 0;
+    memcpy_to_page(page, 0, buffer + offset, n);
+    zero_user_segment(page, n, PAGE_SIZE);
 
-      *offset = pos + len;
-      return (ssize_t)len;
+    if (xa_cmpxchg(&fd->pages, index + i, NIFS_REMOTE_PAGE, page, GFP_KERNEL) != NIFS_REMOTE_PAGE) {
+      __free_page(page);
+      continue;
     }
+    atomic_long_inc(&fd->sbi->stats.pages_allocated);
+    atomic_long_inc(&fd->sbi->stats.pages_fetched);
+    nifs_file_data_charge(fd, 1);
   }
+}
 
-  return -ENOENT;
+// Whether a "read" reply is usable: the backend's result is the number of bytes
+// it read, and at least that many (up to len) have to have arrived
+static bool nifs_file_data_reply_ok(int64_t ret, size_t received, size_t len) {
+  return ret >= 0 && received >= min_t(u64, ret, len);
 }
 
-static int nifs_link(
-    struct dentry* old_dentry, struct inode* parent_dir, struct dentry* new_dentry
+// Fills in args for a "read" of count pages from index
+static void nifs_file_data_read_args(
+    struct nifs_file_data* fd,
+    pgoff_t index,
+    unsigned int count,
+    char ino[24],
+    char offset[24],
+    char length[24]
 ) {
-  const char* new_name = new_dentry->d_name.name;
-  struct inode* target_inode = d_inode(old_dentry);
-  struct nifs_dir_entry* parent_dir_entry;
+  snprintf(ino, 24, "%lu", fd->inode_number);
+  snprintf(offset, 24, "%llu", (u64)index << PAGE_SHIFT);
+  snprintf(length, 24, "%zu", (size_t)count << PAGE_SHIFT);
+}
 
-  LOG("Creating hard link: %s -> %s (inode %lu)\n",
-      new_name,
-      old_dentry->d_name.name,
-      target_inode->i_ino);
+// Fetches count pages from index. Called with fd->lock held for reading, which
+// is dropped for the round trip: returns -EAGAIN, with nothing installed, if a
+// write or an eviction meanwhile may have made the reply stale.
+static int nifs_file_data_fetch(struct nifs_file_data* fd, pgoff_t index, unsigned int count) {
+  struct nifs_sb_info* sbi = fd->sbi;
+  char ino[24], offset[24], length[24];
+  size_t len = (size_t)count << PAGE_SHIFT;
+  size_t received = 0;
+  unsigned long gen = fd->gen;
+
+  char* buffer = kvmalloc(len, GFP_KERNEL);
+  if (!buffer) {
+    return -ENOMEM;
+  }
 
-  struct nifs_file_entry* source_entry = NULL;
-  struct nifs_file_entry* entry;
+  nifs_file_data_read_args(fd, index, count, ino, offset, length);
+  up_read(&fd->lock);
+  int64_t ret = vtfs_http_call(
+      &sbi->http,
+      sbi->token,
+      "read",
+      buffer,
+      len,
+      &received,
+      3,
+      "inode",
+      ino,
+      "offset",
+      offset,
+      "length",
+      length
+  );
+  down_read(&fd->lock);
 
-  list_for_each_entry(entry, &nifs_files, global_list) {
-    if (entry->inode_number == target_inode->i_ino) {
-      source_entry = entry;
-      break;
-    }
+  bool ok = nifs_file_data_reply_ok(ret, received, len);
+  bool stale = ok && fd->gen != gen;
+  if (ok && !stale) {
+    nifs_file_data_install(fd, index, count, buffer, received);
   }
+  kvfree(buffer);
 
-  if (!source_entry) {
-    return -ENOENT;
+  if (stale) {
+    return -EAGAIN;
   }
-
-  if (S_ISDIR(target_inode->i_mode)) {
-    return -EPERM;
+  if (!ok) {
+    LOG("Fetch of inode %lu at page %lu failed: %lld, %zu bytes received\n",
+        fd->inode_number,
+        index,
+        ret,
+        received);
+    return -EIO;
   }
+  return 0;
+}
 
-  parent_dir_entry = nifs_find_directory(parent_dir->i_ino);
-  if (!parent_dir_entry) {
-    return -ENOENT;
-  }
+struct nifs_prefetch {
+  struct nifs_file_data* fd;  // Referenced until done
+  pgoff_t index;
+  unsigned int count;
+  unsigned long gen;          // fd->gen when the request was sent
+  char* buffer;
+};
 
-  if (nifs_find_file_in_dir(parent_dir_entry, new_name) ||
-      nifs_find_subdir(parent_dir_entry, new_name)) {
-    return -EEXIST;
+static void nifs_file_data_prefetch_done(void* ctx, int64_t ret, size_t received) {
+  struct nifs_prefetch* prefetch = ctx;
+  struct nifs_file_data* fd = prefetch->fd;
+  size_t len = (size_t)prefetch->count << PAGE_SHIFT;
+
+  // A page written or evicted since may have been uploaded in between, making
+  // the reply older than the backend. Eviction and writes hold the lock for
+  // writing, so the generation can't move before the pages are in.
+  down_read(&fd->lock);
+  if (nifs_file_data_reply_ok(ret, received, len) && fd->gen == prefetch->gen) {
+    nifs_file_data_install(fd, prefetch->index, prefetch->count, prefetch->buffer, received);
   }
+  up_read(&fd->lock);
 
-  struct nifs_file_entry* new_entry = kmalloc(sizeof(struct nifs_file_entry), GFP_KERNEL);
-  if (!new_entry) {
-    return -ENOMEM;
+  atomic_set(&fd->ra_inflight, 0);
+  kvfree(prefetch->buffer);
+  kfree(prefetch);
+  nifs_put_file_data(fd);
+}
+
+// Starts fetching count pages from index in the background, unless a prefetch
+// of this file is already running. Returns whether one was started.
+static bool nifs_file_data_prefetch(struct nifs_file_data* fd, pgoff_t index, unsigned int count) {
+  struct nifs_sb_info* sbi = fd->sbi;
+  char ino[24], offset[24], length[24];
+
+  if (!count || xa_load(&fd->pages, index) != NIFS_REMOTE_PAGE ||
+      atomic_cmpxchg(&fd->ra_inflight, 0, 1) != 0) {
+    return false;
   }
 
-  new_entry->name = kmalloc(strlen(new_name) + 1, GFP_KERNEL);
-  if (!new_entry->name) {
-    kfree(new_entry);
-    return -ENOMEM;
+  struct nifs_prefetch* prefetch = kmalloc(sizeof(*prefetch), GFP_KERNEL);
+  char* buffer = kvmalloc((size_t)count << PAGE_SHIFT, GFP_KERNEL);
+  if (!prefetch || !buffer) {
+    goto out_free;
   }
-  strcpy(new_entry->name, new_name);
 
-  // 6. Set new entry's data pointer to the source entry's data
-  new_entry->data = source_entry->data;
+  prefetch->fd = nifs_get_file_data(fd);
+  prefetch->index = index;
+  prefetch->count = count;
+  prefetch->gen = fd->gen;
+  prefetch->buffer = buffer;
+
+  nifs_file_data_read_args(fd, index, count, ino, offset, length);
+  // Best effort, and workers completing prefetches need fd->lock, held here
+  int ret = vtfs_http_try_submit(
+      &sbi->http,
+      sbi->token,
+      "read",
+      NULL,
+      0,
+      buffer,
+      (size_t)count << PAGE_SHIFT,
+      VTFS_HTTP_TIMEOUT,
+      nifs_file_data_prefetch_done,
+      prefetch,
+      3,
+      "inode",
+      ino,
+      "offset",
+      offset,
+      "length",
+      length
+  );
+  if (!ret) {
+    return true;
+  }
+  nifs_put_file_data(fd);
 
-  // 7. Set new entry's inode_number to the source's inode_number
-  new_entry->inode_number = source_entry->inode_number;
-  new_entry->parent_inode = parent_dir->i_ino;
+out_free:
+  kvfree(buffer);
+  kfree(prefetch);
+  atomic_set(&fd->ra_inflight, 0);
+  return false;
+}
 
-  INIT_LIST_HEAD(&new_entry->parent_list);
-  INIT_LIST_HEAD(&new_entry->global_list);
+// Pages from index up to EOF, at most count. Called with fd->lock held.
+static unsigned int nifs_file_data_clip_pages(
+    struct nifs_file_data* fd, pgoff_t index, unsigned int count
+) {
+  pgoff_t end = DIV_ROUND_UP(fd->size, PAGE_SIZE);
+  return index < end ? min_t(pgoff_t, count, end - index) : 0;
+}
 
-  // 8. Add to parent directory and global list
-  list_add_tail(&new_entry->parent_list, &parent_dir_entry->files);
-  list_add_tail(&new_entry->global_list, &nifs_files);
+// Fetches the remote page at index along with the rest of the readahead window.
+// The window doubles on every sequential miss, up to NIFS_RA_MAX_PAGES, and the
+// window after it is prefetched right away. Called with fd->lock held for
+// reading, dropped while fetching, see nifs_file_data_fetch.
+static int nifs_file_data_readahead(struct nifs_file_data* fd, pgoff_t index) {
+  unsigned int window = READ_ONCE(fd->ra_pages);
 
-  // 9. Increment the inode's i_nlink
-  inc_nlink(target_inode);
+  if (index == READ_ONCE(fd->ra_next)) {
+    window = clamp_t(unsigned int, window * 2, NIFS_RA_MIN_PAGES, NIFS_RA_MAX_PAGES);
+  } else {
+    window = NIFS_RA_MIN_PAGES;
+  }
 
-  // 10. Link the dentry to the existing inode
-  d_instantiate(new_dentry, igrab(target_inode));
+  unsigned int count = max(nifs_file_data_clip_pages(fd, index, window), 1U);
+  int ret = nifs_file_data_fetch(fd, index, count);
+  if (ret) {
+    return ret;
+  }
 
-  LOG("Hard link created: %s -> inode %lu (link count: %u)\n",
-      new_name,
-      target_inode->i_ino,
-      target_inode->i_nlink);
+  pgoff_t next = index + count;
+  unsigned int ahead = nifs_file_data_clip_pages(fd, next, window);
+  if (nifs_file_data_prefetch(fd, next, ahead)) {
+    WRITE_ONCE(fd->ra_mark, next);
+    next += ahead;
+  }
 
+  WRITE_ONCE(fd->ra_pages, window);
+  WRITE_ONCE(fd->ra_next, next);
   return 0;
 }
 
-// ====== =============== ======
-
-static int nifs_iterate(struct file* filp, struct dir_context* ctx) {
-  struct dentry* dentry = filp->f_path.dentry;
-  struct inode* inode = dentry->d_inode;
-  loff_t pos = ctx->pos;
-
-  struct nifs_dir_entry* dir = nifs_find_directory(inode->i_ino);
-  if (!dir) {
-    return 0;
+// A reader got to the prefetched window: prefetch the one after it, before it misses
+static void nifs_file_data_readahead_mark(struct nifs_file_data* fd) {
+  unsigned int window =
+      clamp_t(unsigned int, READ_ONCE(fd->ra_pages) * 2, NIFS_RA_MIN_PAGES, NIFS_RA_MAX_PAGES);
+  pgoff_t next = READ_ONCE(fd->ra_next);
+  unsigned int ahead = nifs_file_data_clip_pages(fd, next, window);
+
+  WRITE_ONCE(fd->ra_mark, ULONG_MAX);
+  if (nifs_file_data_prefetch(fd, next, ahead)) {
+    WRITE_ONCE(fd->ra_mark, next);
+    WRITE_ONCE(fd->ra_pages, window);
+    WRITE_ONCE(fd->ra_next, next + ahead);
   }
+}
 
-  // "." entry
-  if (pos == 0) {
-    if (!dir_emit(ctx, ".", 1, inode->i_ino, DT_DIR)) {
-      return 0;
-    }
-    ctx->pos = 1;
-    return 0;
+static void nifs_file_data_touch(struct nifs_file_data* fd) {
+  if (!READ_ONCE(fd->lru_referenced)) {
+    WRITE_ONCE(fd->lru_referenced, true);
   }
+}
 
-  // ".." entry
-  if (pos == 1) {
-    struct dentry* parent = dentry->d_parent;
-    struct inode* parent_inode = parent->d_inode;
-    if (!dir_emit(ctx, "..", 2, parent_inode->i_ino, DT_DIR)) {
-      return 0;
+// Returns the page backing index, NULL for a hole, fetching it first if it only
+// lives on the backend. Called with fd->lock held for reading. The lock is
+// dropped while fetching, so the caller has to recheck the size afterwards.
+static struct page* nifs_file_data_load(struct nifs_file_data* fd, pgoff_t index) {
+  struct page* page = xa_load(&fd->pages, index);
+
+  nifs_file_data_touch(fd);
+
+  if (page != NIFS_REMOTE_PAGE) {
+    if (page && index == READ_ONCE(fd->ra_mark)) {
+      nifs_file_data_readahead_mark(fd);
     }
-    ctx->pos = 2;
-    return 0;
+    return page;
   }
 
-  // Count subdirectories first
-  int subdir_count = 0;
-  struct nifs_dir_entry* subdir;
-  list_for_each_entry(subdir, &dir->subdirs, parent_list) {
-    subdir_count++;
+  for (;;) {
+    int ret = nifs_file_data_readahead(fd, index);
+    page = xa_load(&fd->pages, index);
+    if (page != NIFS_REMOTE_PAGE) {
+      return page;  // Possibly put there or truncated away by someone else
+    }
+    if (ret != -EAGAIN) {
+      return ERR_PTR(ret ? ret : -ENOMEM);  // Fetched, but no memory to keep it
+    }
   }
+}
 
-  // Subdirectories
-  int subdir_idx = 0;
-  list_for_each_entry(subdir, &dir->subdirs, parent_list) {
-    if (pos == 2 + subdir_idx) {
-      if (!dir_emit(ctx, subdir->name, strlen(subdir->name), subdir->inode_number, DT_DIR)) {
-        return 0;
+// Returns with fd->lock held for writing once none of the pages the caller is
+// about to read under it lives on the backend only: every page of [start, end)
+// holding data, or with edges_only just those the range covers partially below
+// EOF. Fetching needs the lock dropped, so this loops until nothing was evicted
+// again in between.
+static int nifs_file_data_lock_resident(
+    struct nifs_file_data* fd, loff_t start, loff_t end, bool edges_only
+) {
+  pgoff_t resume = start >> PAGE_SHIFT;  // Pages before it were here last time
+
+  for (;;) {
+    down_write(&fd->lock);
+
+    pgoff_t index = ULONG_MAX;
+    if (edges_only) {
+      loff_t stored = min_t(loff_t, end, fd->size);
+      pgoff_t first = start >> PAGE_SHIFT;
+      pgoff_t tail = stored >> PAGE_SHIFT;
+      if (start >= stored) {
+        // Nothing stored in the range
+      } else if ((offset_in_page(start) || first == tail) &&
+                 xa_load(&fd->pages, first) == NIFS_REMOTE_PAGE) {
+        index = first;
+      } else if (offset_in_page(stored) && xa_load(&fd->pages, tail) == NIFS_REMOTE_PAGE) {
+        index = tail;
       }
-      ctx->pos++;
+    } else if (start < end && fd->size) {
+      pgoff_t last = min_t(pgoff_t, (end - 1) >> PAGE_SHIFT, (fd->size - 1) >> PAGE_SHIFT);
+      struct page* page;
+      for (;;) {
+        pgoff_t i = resume;
+        xa_for_each_range(&fd->pages, i, page, resume, last) {
+          if (page == NIFS_REMOTE_PAGE) {
+            index = i;
+            break;
+          }
+        }
+        if (index != ULONG_MAX || resume == start >> PAGE_SHIFT) {
+          break;
+        }
+        resume = start >> PAGE_SHIFT;  // Once more from the start, for pages evicted meanwhile
+      }
+      resume = index;
+    }
+    if (index == ULONG_MAX) {
       return 0;
     }
-    subdir_idx++;
-  }
 
-  // Files
-  struct nifs_file_entry* file;
-  int file_idx = 0;
-  list_for_each_entry(file, &dir->files, parent_list) {
-    if (pos == 2 + subdir_count + file_idx) {
-      if (!dir_emit(ctx, file->name, strlen(file->name), file->inode_number, DT_REG)) {
-        return 0;
-      }
-      ctx->pos++;
-      return 0;
+    downgrade_write(&fd->lock);
+    struct page* page = nifs_file_data_load(fd, index);
+    up_read(&fd->lock);
+    if (IS_ERR(page)) {
+      return PTR_ERR(page);
     }
-    file_idx++;
   }
-
-  // Nothing more to emit
-  return 0;
 }
 
-static struct dentry* nifs_lookup(
-    struct inode* parent_inode,  // родительская нода
-    struct dentry* child_dentry,  // объект, к которому мы пытаемся получить доступ
-    unsigned int flag  // неиспользуемое значение
-) {
-  LOG("LOOKUP!");
-  const char* name = child_dentry->d_name.name;
-  struct nifs_dir_entry* parent_dir = nifs_find_directory(parent_inode->i_ino);
+// Returns the page backing index, NULL for a hole. Called with fd->lock held
+// for writing, and after nifs_file_data_lock_resident for index.
+static struct page* nifs_file_data_peek(struct nifs_file_data* fd, pgoff_t index) {
+  struct page* page = xa_load(&fd->pages, index);
+
+  nifs_file_data_touch(fd);
+  if (WARN_ON_ONCE(page == NIFS_REMOTE_PAGE)) {
+    return ERR_PTR(-EIO);
+  }
+  return page;
+}
+
+// ------ ------------ ------
+
+// Returns the page backing index, allocating a zeroed one if there is none yet.
+// Called like nifs_file_data_peek.
+static struct page* nifs_file_data_get_page(struct nifs_file_data* fd, pgoff_t index) {
+  struct page* page = nifs_file_data_peek(fd, index);
+  if (page) {
+    return page;
+  }
+
+  page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+  if (!page) {
+    return ERR_PTR(-ENOMEM);
+  }
+
+  int ret = xa_err(xa_store(&fd->pages, index, page, GFP_KERNEL));
+  if (ret) {
+    __free_page(page);
+    return ERR_PTR(ret);
+  }
+  atomic_long_inc(&fd->sbi->stats.pages_allocated);
+  nifs_file_data_charge(fd, 1);
+  return page;
+}
+
+// Bytes past EOF are always zero in the stored pages, so growing only moves the
+// size, and dirties whatever the backend may still hold past the old one
+static int nifs_resize_file_data(struct nifs_file_data* fd, size_t new_size) {
+  size_t tail = offset_in_page(new_size);
+
+  // A remote tail page is fetched, its bytes past EOF must read as zeros later.
+  // Done first, so that a failed fetch leaves the file as it was.
+  int ret = nifs_file_data_lock_resident(fd, new_size, tail ? new_size + 1 : new_size, true);
+  if (ret) {
+    return ret;
+  }
+
+  if (new_size < fd->size) {
+    struct page* page = tail ? nifs_file_data_peek(fd, new_size >> PAGE_SHIFT) : NULL;
+    if (IS_ERR(page)) {
+      up_write(&fd->lock);
+      return PTR_ERR(page);
+    }
+    if (page) {
+      zero_user_segment(page, tail, PAGE_SIZE);
+    }
+
+    nifs_file_data_free_pages(fd, DIV_ROUND_UP(new_size, PAGE_SIZE), ULONG_MAX);
+  } else {
+    nifs_writeback_grow(fd, new_size);
+  }
+
+  fd->size = new_size;
+  nifs_writeback_mark(fd, NULL, 0, 0, true);
+
+  up_write(&fd->lock);
+  return 0;
+}
+
+static int nifs_file_data_zero(struct nifs_file_data* fd, pgoff_t index, size_t from, size_t to) {
+  struct page* page = nifs_file_data_peek(fd, index);
+  if (IS_ERR(page)) {
+    return PTR_ERR(page);
+  }
+  if (page) {
+    zero_user_segment(page, from, to);
+  }
+  return 0;
+}
+
+// Zeroes [offset, offset + len), giving back every page the range fully covers
+static int nifs_file_data_punch_hole(struct nifs_file_data* fd, loff_t offset, loff_t len) {
+  struct nifs_dirty_range* range = nifs_writeback_range_alloc(fd);
+
+  // Only the partly punched pages are read, and need to be here first
+  int ret = nifs_file_data_lock_resident(fd, offset, offset + len, true);
+  if (ret) {
+    kfree(range);
+    return ret;
+  }
+
+  loff_t end = min_t(loff_t, offset + len, fd->size);
+  pgoff_t first = offset >> PAGE_SHIFT;
+  pgoff_t tail = end >> PAGE_SHIFT;
+
+  if (offset >= end) {
+    // Nothing stored in the range
+  } else if (first == tail) {
+    ret = nifs_file_data_zero(fd, first, offset_in_page(offset), offset_in_page(end));
+  } else {
+    if (offset_in_page(offset)) {
+      ret = nifs_file_data_zero(fd, first, offset_in_page(offset), PAGE_SIZE);
+      first++;
+    }
+    if (!ret && offset_in_page(end)) {
+      ret = nifs_file_data_zero(fd, tail, 0, offset_in_page(end));
+    }
+    if (!ret && first < tail) {
+      nifs_file_data_free_pages(fd, first, tail - 1);
+    }
+  }
+
+  // Even a failed punch may have zeroed part of the range
+  nifs_writeback_mark(fd, range, offset, end, false);
+
+  up_write(&fd->lock);
+  return ret;
+}
+
+// SEEK_DATA/SEEK_HOLE at page granularity: stored pages are data, missing ones are holes
+static loff_t nifs_file_data_seek(struct nifs_file_data* fd, loff_t offset, int whence) {
+  loff_t ret;
+
+  down_read(&fd->lock);
+
+  if (offset < 0 || offset >= fd->size) {
+    ret = -ENXIO;
+    goto out;
+  }
+
+  ulong index = offset >> PAGE_SHIFT;
+  ulong last = (fd->size - 1) >> PAGE_SHIFT;
+
+  if (whence == SEEK_DATA) {
+    if (!xa_find(&fd->pages, &index, last, XA_PRESENT)) {
+      ret = -ENXIO;
+    } else {
+      ret = max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT);
+    }
+    goto out;
+  }
+
+  struct page* page;
+  ulong next = index;
+  xa_for_each_range(&fd->pages, index, page, next, last) {
+    if (index != next) {
+      break;
+    }
+    next++;
+  }
+
+  ret = max_t(loff_t, offset, (loff_t)next << PAGE_SHIFT);
+  ret = min_t(loff_t, ret, fd->size);  // EOF is an implicit hole
+
+out:
+  up_read(&fd->lock);
+  return ret;
+}
+
+// How far from offset, but no further than end, the store keeps being data, or
+// a hole if *hole is set. Unlike SEEK_HOLE it never walks past end, so reads
+// that probe it chunk by chunk stay linear in the file size.
+static loff_t nifs_file_data_extent(
+    struct nifs_file_data* fd, loff_t offset, loff_t end, bool* hole
+) {
+  down_read(&fd->lock);
+
+  end = min_t(loff_t, end, fd->size);
+  if (offset >= end) {
+    up_read(&fd->lock);
+    *hole = true;
+    return offset;  // Truncated meanwhile
+  }
+
+  ulong index = offset >> PAGE_SHIFT;
+  ulong last = (end - 1) >> PAGE_SHIFT;
+  ulong next = index;
+
+  *hole = !xa_load(&fd->pages, index);
+  if (*hole) {
+    if (!xa_find(&fd->pages, &next, last, XA_PRESENT)) {
+      next = last + 1;
+    }
+  } else {
+    struct page* page;
+    xa_for_each_range(&fd->pages, index, page, next, last) {
+      if (index != next) {
+        break;
+      }
+      next++;
+    }
+  }
+
+  up_read(&fd->lock);
+  return min_t(loff_t, end, (loff_t)next << PAGE_SHIFT);
+}
+
+// Copies file data at pos into to, stopping at EOF; returns the number of bytes
+// copied, or an error if a remote page couldn't be fetched
+static ssize_t nifs_file_data_read_iter(
+    struct nifs_file_data* fd, loff_t pos, struct iov_iter* to
+) {
+  ssize_t read = 0;
+
+  down_read(&fd->lock);
+
+  while (pos < fd->size && iov_iter_count(to)) {
+    struct page* page = nifs_file_data_load(fd, pos >> PAGE_SHIFT);
+    if (IS_ERR(page)) {
+      read = PTR_ERR(page);
+      break;
+    }
+    if (pos >= fd->size) {
+      break;  // Truncated while fetching
+    }
+
+    size_t offset = offset_in_page(pos);
+    size_t len = min_t(size_t, iov_iter_count(to), PAGE_SIZE - offset);
+    len = min_t(size_t, len, fd->size - pos);
+    size_t copied = page ? copy_page_to_iter(page, offset, len, to) : iov_iter_zero(len, to);
+
+    read += copied;
+    pos += copied;
+    if (copied < len) {
+      break;
+    }
+  }
+
+  up_read(&fd->lock);
+  return read;
+}
+
+// Copies from into file data at pos, extending the file as needed if extend is
+// set, or dropping whatever lies past EOF otherwise
+static ssize_t nifs_file_data_write_iter(
+    struct nifs_file_data* fd, loff_t pos, struct iov_iter* from, bool extend
+) {
+  struct nifs_dirty_range* range = nifs_writeback_range_alloc(fd);
+  loff_t start = pos;
+  size_t written = 0;
+
+  atomic_long_inc(&fd->sbi->stats.writes);
+
+  int ret = nifs_file_data_lock_resident(fd, pos, pos + iov_iter_count(from), false);
+  if (ret) {
+    kfree(range);
+    return ret;
+  }
+  fd->gen++;
+
+  if (!extend) {
+    iov_iter_truncate(from, pos < fd->size ? fd->size - pos : 0);
+  }
+
+  while (iov_iter_count(from)) {
+    size_t offset = offset_in_page(pos);
+    size_t len = min_t(size_t, iov_iter_count(from), PAGE_SIZE - offset);
+
+    struct page* page = nifs_file_data_get_page(fd, pos >> PAGE_SHIFT);
+    if (IS_ERR(page)) {
+      if (!written) {
+        up_write(&fd->lock);
+        kfree(range);
+        return PTR_ERR(page);
+      }
+      break;
+    }
+
+    size_t copied = copy_page_from_iter(page, offset, len, from);
+    written += copied;
+    pos += copied;
+    if (copied < len) {
+      break;
+    }
+  }
+
+  if (pos > fd->size) {
+    nifs_writeback_grow(fd, pos);
+    fd->size = pos;
+  }
+  nifs_writeback_mark(fd, range, start, pos, false);
+
+  up_write(&fd->lock);
+  return written;
+}
+
+static void nifs_free_file_data_rcu(struct rcu_head* head) {
+  kmem_cache_free(nifs_file_data_cache, container_of(head, struct nifs_file_data, rcu));
+}
+
+// Pages go back right away, the object itself once lockless lookups are done
+// with it. Giving back the last page takes fd off the LRU.
+static void nifs_free_file_data(struct nifs_file_data* fd) {
+  if (fd) {
+    nifs_file_data_free_pages(fd, 0, ULONG_MAX);
+    xa_destroy(&fd->pages);
+    call_rcu(&fd->rcu, nifs_free_file_data_rcu);
+  }
+}
+
+static void nifs_release_file_data(struct kref* ref) {
+  nifs_free_file_data(container_of(ref, struct nifs_file_data, refcount));
+}
+
+static struct nifs_file_data* nifs_get_file_data(struct nifs_file_data* fd) {
+  kref_get(&fd->refcount);
+  return fd;
+}
+
+// For RCU readers: fails if the last reference is already gone
+static struct nifs_file_data* nifs_tryget_file_data(struct nifs_file_data* fd) {
+  return kref_get_unless_zero(&fd->refcount) ? fd : NULL;
+}
+
+static void nifs_put_file_data(struct nifs_file_data* fd) {
+  kref_put(&fd->refcount, nifs_release_file_data);
+}
+
+// ====== ==================== ======
+
+// ====== WRITE-BACK ======
+
+// Largest upload a dirty range is split into
+#define NIFS_WRITEBACK_CHUNK (1 << 20)
+
+// Inserts range into the sorted, disjoint dirty ranges of fd, merging it with
+// every range it overlaps or touches. Called with fd->lock held for writing.
+static void nifs_dirty_ranges_add(struct nifs_file_data* fd, struct nifs_dirty_range* range) {
+  struct nifs_dirty_range* cur;
+  struct nifs_dirty_range* tmp;
+  struct list_head* next = &fd->dirty_ranges;
+
+  list_for_each_entry_safe(cur, tmp, &fd->dirty_ranges, node) {
+    if (cur->end < range->start) {
+      continue;
+    }
+    if (cur->start > range->end) {
+      next = &cur->node;
+      break;
+    }
+    range->start = min(range->start, cur->start);
+    range->end = max(range->end, cur->end);
+    fd->dirty_bytes -= cur->end - cur->start;
+    list_del(&cur->node);
+    kfree(cur);
+  }
+
+  list_add_tail(&range->node, next);
+  fd->dirty_bytes += range->end - range->start;
+}
+
+// Drops dirty data past size. Called with fd->lock held for writing.
+static void nifs_dirty_ranges_clip(struct nifs_file_data* fd, loff_t size) {
+  struct nifs_dirty_range* cur;
+  struct nifs_dirty_range* tmp;
+
+  list_for_each_entry_safe(cur, tmp, &fd->dirty_ranges, node) {
+    if (cur->start >= size) {
+      fd->dirty_bytes -= cur->end - cur->start;
+      list_del(&cur->node);
+      kfree(cur);
+    } else if (cur->end > size) {
+      fd->dirty_bytes -= cur->end - size;
+      cur->end = size;
+    }
+  }
+}
+
+// Puts fd on the dirty list if it has anything to upload and isn't there yet,
+// and kicks the flusher. Called with fd->lock held for writing.
+static void nifs_writeback_account(struct nifs_file_data* fd, long delta) {
+  struct nifs_sb_info* sbi = fd->sbi;
+  bool first = false;
+
+  if (list_empty(&fd->dirty_node) && (fd->dirty_bytes || fd->size_dirty)) {
+    fd->dirtied_when = jiffies;
+    nifs_get_file_data(fd);  // Dropped once clean again
+
+    spin_lock(&sbi->dirty_lock);
+    first = list_empty(&sbi->dirty_files);
+    list_add_tail(&fd->dirty_node, &sbi->dirty_files);
+    spin_unlock(&sbi->dirty_lock);
+  }
+
+  if (atomic_long_add_return(delta, &sbi->dirty_bytes) > sbi->dirty_limit) {
+    mod_delayed_work(system_unbound_wq, &sbi->flush_work, 0);
+  } else if (first) {
+    queue_delayed_work(system_unbound_wq, &sbi->flush_work, sbi->dirty_expire);
+  }
+  if (delta < 0) {
+    wake_up_all(&sbi->dirty_wait);  // Truncated away
+  }
+}
+
+// Dirty data can't be evicted until uploaded, so while more than dirty_limit
+// bytes are dirty, writers wait for the flusher instead of adding to them, like
+// balance_dirty_pages does. Must be called with no fd->lock or folio lock held.
+static int nifs_writeback_throttle(struct nifs_sb_info* sbi) {
+  if (!sbi->writeback || atomic_long_read(&sbi->dirty_bytes) <= sbi->dirty_limit) {
+    return 0;
+  }
+
+  mod_delayed_work(system_unbound_wq, &sbi->flush_work, 0);
+  return wait_event_killable(
+      sbi->dirty_wait, atomic_long_read(&sbi->dirty_bytes) <= sbi->dirty_limit
+  );
+}
+
+// The range for nifs_writeback_mark, allocated before fd->lock is taken. Too
+// small to fail, and a write that can't be tracked would be lost.
+static struct nifs_dirty_range* nifs_writeback_range_alloc(struct nifs_file_data* fd) {
+  if (!fd->sbi->writeback) {
+    return NULL;
+  }
+  return kmalloc(sizeof(struct nifs_dirty_range), GFP_KERNEL | __GFP_NOFAIL);
+}
+
+// Records that [start, end) changed, and that the size did if resized. Must be
+// called in the same fd->lock write section as the change itself: eviction takes
+// anything outside the dirty ranges to be on the backend already. Takes over
+// range, freeing it if there is nothing to record.
+static void nifs_writeback_mark(
+    struct nifs_file_data* fd,
+    struct nifs_dirty_range* range,
+    loff_t start,
+    loff_t end,
+    bool resized
+) {
+  if (!fd->sbi->writeback) {
+    return;
+  }
+  if (!fd->nlink) {
+    kfree(range);  // Unlinked, kept in memory until closed, see nifs_writeback_discard
+    return;
+  }
+
+  long old_bytes = fd->dirty_bytes;
+
+  if (resized) {
+    nifs_dirty_ranges_clip(fd, fd->size);
+    fd->size_dirty = true;
+  }
+  if (range && start < end) {
+    range->start = start;
+    range->end = end;
+    nifs_dirty_ranges_add(fd, range);
+    range = NULL;
+  }
+  kfree(range);
+
+  nifs_writeback_account(fd, (long)fd->dirty_bytes - old_bytes);
+}
+
+// Bytes past EOF read as zeros, but after a truncate the backend keeps what it
+// had there until the next upload. Before the size grows to new_size, the part
+// of the newly exposed range the backend may still hold is marked dirty, so it
+// is overwritten with zeros and not evicted and fetched back meanwhile. Called
+// with fd->lock held for writing.
+static void nifs_writeback_grow(struct nifs_file_data* fd, loff_t new_size) {
+  loff_t end = min_t(loff_t, new_size, fd->remote_size);
+
+  if (!fd->sbi->writeback || fd->size >= end) {
+    return;
+  }
+  // Reclaim can't come back for fd->lock without __GFP_FS, see nifs_cache_scan
+  struct nifs_dirty_range* range = kmalloc(sizeof(*range), GFP_NOFS | __GFP_NOFAIL);
+  nifs_writeback_mark(fd, range, fd->size, end, false);
+}
+
+// Records the size the backend may have after an upload that carried size.
+// Uploads of a file are serialized by flush_lock, the last one sent wins.
+static void nifs_writeback_sent(struct nifs_file_data* fd, size_t size, bool ok) {
+  down_write(&fd->lock);
+  fd->remote_size = ok ? size : max(fd->remote_size, size);  // A failed one may have landed
+  up_write(&fd->lock);
+}
+
+// Sends len bytes of fd from pos, along with the current size. The backend
+// stores them at pos and truncates or extends the file to size.
+static int nifs_writeback_upload(struct nifs_file_data* fd, loff_t pos, size_t len) {
+  struct nifs_sb_info* sbi = fd->sbi;
+  char ino[24], offset[24], size[24];
+  char* buffer = NULL;
+  size_t file_size;
+
+  if (len) {
+    buffer = kvmalloc(len, GFP_KERNEL);
+    if (!buffer) {
+      return -ENOMEM;
+    }
+
+    struct kvec kvec = {.iov_base = buffer, .iov_len = len};
+    struct iov_iter iter;
+    iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, len);
+    ssize_t read = nifs_file_data_read_iter(fd, pos, &iter);  // Short if truncated meanwhile
+    if (read < 0) {
+      kvfree(buffer);
+      return read;
+    }
+    len = read;
+  }
+
+  down_read(&fd->lock);
+  file_size = fd->size;
+  up_read(&fd->lock);
+  snprintf(size, sizeof(size), "%zu", file_size);
+  snprintf(ino, sizeof(ino), "%lu", fd->inode_number);
+  snprintf(offset, sizeof(offset), "%lld", pos);
+
+  int64_t ret = vtfs_http_post(
+      &sbi->http,
+      sbi->token,
+      "write",
+      buffer,
+      len,
+      NULL,
+      0,
+      3,
+      "inode",
+      ino,
+      "offset",
+      offset,
+      "size",
+      size
+  );
+  kvfree(buffer);
+  nifs_writeback_sent(fd, file_size, ret >= 0);
+
+  if (ret < 0) {
+    LOG("Upload of inode %lu at %lld failed: %lld\n", fd->inode_number, pos, ret);
+    return -EIO;
+  }
+  return 0;
+}
+
+// Ends a flush of fd started under flush_lock. On failure, ranges and
+// size_dirty are marked dirty again, otherwise ranges are freed. Returns true
+// if the dirty list dropped its reference to fd.
+static bool nifs_writeback_settle(
+    struct nifs_file_data* fd,
+    struct list_head* ranges,
+    bool size_dirty,
+    int ret
+) {
+  struct nifs_sb_info* sbi = fd->sbi;
+  struct nifs_dirty_range* range;
+  struct nifs_dirty_range* tmp;
+  bool put = false;
+
+  down_write(&fd->lock);
+
+  if (ret) {
+    long old_bytes = fd->dirty_bytes;
+    list_for_each_entry_safe(range, tmp, ranges, node) {
+      list_del(&range->node);
+      nifs_dirty_ranges_add(fd, range);
+    }
+    nifs_dirty_ranges_clip(fd, fd->size);
+    fd->size_dirty |= size_dirty;
+    atomic_long_add((long)fd->dirty_bytes - old_bytes, &sbi->dirty_bytes);
+  } else {
+    list_for_each_entry_safe(range, tmp, ranges, node) {
+      list_del(&range->node);
+      kfree(range);
+    }
+  }
+
+  // Still dirty files go to the back of the line
+  spin_lock(&sbi->dirty_lock);
+  if (!list_empty(&fd->dirty_node)) {
+    if (list_empty(&fd->dirty_ranges) && !fd->size_dirty) {
+      list_del_init(&fd->dirty_node);
+      put = true;
+    } else {
+      fd->dirtied_when = jiffies;
+      list_move_tail(&fd->dirty_node, &sbi->dirty_files);
+    }
+  }
+  spin_unlock(&sbi->dirty_lock);
+
+  up_write(&fd->lock);
+  wake_up_all(&sbi->dirty_wait);
+  return put;
+}
+
+// Uploads the dirty data of fd. Whatever fails to upload stays dirty.
+static int nifs_writeback_flush_file(struct nifs_file_data* fd) {
+  struct nifs_sb_info* sbi = fd->sbi;
+  struct nifs_dirty_range* range;
+  struct nifs_dirty_range* tmp;
+  LIST_HEAD(ranges);
+  bool uploaded = false;
+  bool put;
+  int ret = 0;
+
+  if (!sbi || !sbi->writeback) {
+    return 0;
+  }
+
+  mutex_lock(&fd->flush_lock);
+
+  // Writes landing during the upload dirty a fresh set of ranges
+  down_write(&fd->lock);
+  list_splice_init(&fd->dirty_ranges, &ranges);
+  bool size_dirty = fd->size_dirty;
+  size_t bytes = fd->dirty_bytes;
+  fd->size_dirty = false;
+  fd->dirty_bytes = 0;
+  up_write(&fd->lock);
+  atomic_long_sub(bytes, &sbi->dirty_bytes);
+
+  list_for_each_entry_safe(range, tmp, &ranges, node) {
+    while (range->start < range->end) {
+      size_t len = min_t(loff_t, range->end - range->start, NIFS_WRITEBACK_CHUNK);
+      ret = nifs_writeback_upload(fd, range->start, len);
+      if (ret) {
+        goto redirty;
+      }
+      range->start += len;
+      uploaded = true;
+    }
+    list_del(&range->node);
+    kfree(range);
+  }
+
+  // Every upload carries the size, a bare resize needs an empty one
+  if (size_dirty && !uploaded) {
+    ret = nifs_writeback_upload(fd, 0, 0);
+  }
+
+redirty:
+  put = nifs_writeback_settle(fd, &ranges, size_dirty, ret);
+  mutex_unlock(&fd->flush_lock);
+
+  if (put) {
+    nifs_put_file_data(fd);
+  }
+  return ret;
+}
+
+// Most dirty bytes a file can have to share a batch with others, and most
+// bytes one batch carries
+#define NIFS_WRITEBACK_BATCH_FILE (64 << 10)
+#define NIFS_WRITEBACK_BATCH_BYTES NIFS_WRITEBACK_CHUNK
+
+// A file flushed as part of a batch, one "write" per dirty range, or a single
+// empty one if only its size changed
+struct nifs_batch_file {
+  struct nifs_file_data* fd;
+  struct list_head ranges;  // Taken off fd->dirty_ranges
+  bool size_dirty;
+  size_t file_size;
+  char* buffer;             // Data of ranges, back to back
+  size_t first_op;
+  size_t op_count;
+  char ino[24];
+  char size[24];
+};
+
+// Arguments of one "write" in a batch
+struct nifs_batch_args {
+  char offset[24];
+  const char* args[6];
+};
+
+// Uploads of small files going out in one /api/batch round trip
+struct nifs_writeback_batch {
+  struct nifs_batch_file files[VTFS_HTTP_BATCH_MAX];
+  struct nifs_batch_args args[VTFS_HTTP_BATCH_MAX];
+  struct vtfs_http_op ops[VTFS_HTTP_BATCH_MAX];
+  size_t file_count;
+  size_t op_count;
+  size_t bytes;
+};
+
+// Adds the operations of file to batch, reading its dirty data
+static int nifs_writeback_batch_fill(
+    struct nifs_writeback_batch* batch,
+    struct nifs_batch_file* file,
+    size_t bytes
+) {
+  struct nifs_file_data* fd = file->fd;
+  struct nifs_dirty_range* range;
+  size_t used = 0;
+
+  if (bytes) {
+    file->buffer = kvmalloc(bytes, GFP_KERNEL);
+    if (!file->buffer) {
+      return -ENOMEM;
+    }
+  }
+
+  file->first_op = batch->op_count;
+  file->op_count = 0;
+
+  list_for_each_entry(range, &file->ranges, node) {
+    struct kvec kvec = {.iov_base = file->buffer + used, .iov_len = range->end - range->start};
+    struct iov_iter iter;
+    iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, kvec.iov_len);
+    ssize_t read = nifs_file_data_read_iter(fd, range->start, &iter);  // Short if truncated
+    if (read < 0) {
+      return read;
+    }
+
+    struct nifs_batch_args* args = &batch->args[file->first_op + file->op_count];
+    struct vtfs_http_op* op = &batch->ops[file->first_op + file->op_count];
+    snprintf(args->offset, sizeof(args->offset), "%lld", range->start);
+    op->body = kvec.iov_base;
+    op->body_len = read;
+    used += read;
+    file->op_count++;
+  }
+
+  // Every write carries the size, a bare resize needs an empty one
+  if (!file->op_count) {
+    struct nifs_batch_args* args = &batch->args[file->first_op];
+    snprintf(args->offset, sizeof(args->offset), "0");
+    batch->ops[file->first_op].body = NULL;
+    file->op_count = 1;
+  }
+
+  down_read(&fd->lock);
+  file->file_size = fd->size;
+  up_read(&fd->lock);
+  snprintf(file->size, sizeof(file->size), "%zu", file->file_size);
+  snprintf(file->ino, sizeof(file->ino), "%lu", fd->inode_number);
+
+  for (size_t i = file->first_op; i < file->first_op + file->op_count; i++) {
+    struct nifs_batch_args* args = &batch->args[i];
+    args->args[0] = "inode";
+    args->args[1] = file->ino;
+    args->args[2] = "offset";
+    args->args[3] = args->offset;
+    args->args[4] = "size";
+    args->args[5] = file->size;
+
+    batch->ops[i].method = "write";
+    batch->ops[i].args = args->args;
+    batch->ops[i].arg_size = 3;
+    batch->ops[i].response_buffer = NULL;
+    batch->ops[i].buffer_size = 0;
+    batch->ops[i].result = -1;
+  }
+
+  batch->op_count += file->op_count;
+  return 0;
+}
+
+// Takes the dirty state of fd into batch if it is small enough and fits.
+// Returns false, with nothing locked or changed, when fd has to be flushed on
+// its own instead. A file already being uploaded is skipped: its flush_lock is
+// only tried, since blocking on one while holding those of the batch could
+// deadlock against another flusher.
+static bool nifs_writeback_batch_add(
+    struct nifs_writeback_batch* batch,
+    struct nifs_file_data* fd
+) {
+  struct nifs_batch_file* file = &batch->files[batch->file_count];
+  struct nifs_dirty_range* range;
+  size_t ranges = 0;
+
+  if (!mutex_trylock(&fd->flush_lock)) {
+    // Whoever uploads it settles it, this pass must not pick it up again
+    spin_lock(&fd->sbi->dirty_lock);
+    if (!list_empty(&fd->dirty_node)) {
+      fd->dirtied_when = jiffies;
+      list_move_tail(&fd->dirty_node, &fd->sbi->dirty_files);
+    }
+    spin_unlock(&fd->sbi->dirty_lock);
+    return true;
+  }
+  down_write(&fd->lock);
+
+  list_for_each_entry(range, &fd->dirty_ranges, node) {
+    ranges++;
+  }
+  size_t bytes = fd->dirty_bytes;
+  bool taken = (ranges || fd->size_dirty) && bytes <= NIFS_WRITEBACK_BATCH_FILE &&
+               batch->bytes + bytes <= NIFS_WRITEBACK_BATCH_BYTES &&
+               batch->op_count + max_t(size_t, ranges, 1) <= VTFS_HTTP_BATCH_MAX;
+  if (taken) {
+    INIT_LIST_HEAD(&file->ranges);
+    list_splice_init(&fd->dirty_ranges, &file->ranges);
+    file->size_dirty = fd->size_dirty;
+    fd->size_dirty = false;
+    fd->dirty_bytes = 0;
+  }
+
+  up_write(&fd->lock);
+
+  if (!taken) {
+    mutex_unlock(&fd->flush_lock);
+    return false;
+  }
+  atomic_long_sub(bytes, &fd->sbi->dirty_bytes);
+
+  file->fd = fd;
+  file->buffer = NULL;
+  int ret = nifs_writeback_batch_fill(batch, file, bytes);
+  if (ret) {
+    // Stays dirty for the next pass
+    bool put = nifs_writeback_settle(fd, &file->ranges, file->size_dirty, ret);
+    mutex_unlock(&fd->flush_lock);
+    kvfree(file->buffer);
+    if (put) {
+      nifs_put_file_data(fd);
+    }
+    return true;
+  }
+
+  batch->bytes += bytes;
+  batch->file_count++;
+  return true;
+}
+
+// Sends batch and settles each of its files by the outcome of its operations
+static void nifs_writeback_batch_send(
+    struct nifs_sb_info* sbi,
+    struct nifs_writeback_batch* batch
+) {
+  int64_t ret = vtfs_http_call_batch(&sbi->http, sbi->token, batch->ops, batch->op_count);
+  if (ret < 0) {
+    LOG("Batched upload of %zu files failed: %lld\n", batch->file_count, ret);
+  }
+
+  for (size_t i = 0; i < batch->file_count; i++) {
+    struct nifs_batch_file* file = &batch->files[i];
+    struct nifs_file_data* fd = file->fd;
+    bool ok = ret >= 0;
+
+    for (size_t j = file->first_op; j < file->first_op + file->op_count; j++) {
+      ok = ok && batch->ops[j].result >= 0;
+    }
+
+    nifs_writeback_sent(fd, file->file_size, ok);
+    bool put = nifs_writeback_settle(fd, &file->ranges, file->size_dirty, ok ? 0 : -EIO);
+    mutex_unlock(&fd->flush_lock);
+    kvfree(file->buffer);
+
+    if (put) {
+      nifs_put_file_data(fd);
+    }
+  }
+}
+
+// Flushes count files, at most VTFS_HTTP_BATCH_MAX. Those with little dirty
+// data, such as a tree of small files just copied in or files only resized,
+// share one /api/batch round trip. The rest are uploaded one by one, once the
+// batch is sent and its files unlocked.
+static void nifs_writeback_flush_files(
+    struct nifs_sb_info* sbi,
+    struct nifs_file_data** files,
+    size_t count
+) {
+  struct nifs_writeback_batch* batch = kvmalloc(sizeof(*batch), GFP_KERNEL);
+  DECLARE_BITMAP(alone, VTFS_HTTP_BATCH_MAX);
+
+  // Without a batch every file just gets flushed on its own
+  if (!batch) {
+    for (size_t i = 0; i < count; i++) {
+      nifs_writeback_flush_file(files[i]);
+    }
+    return;
+  }
+
+  batch->file_count = 0;
+  batch->op_count = 0;
+  batch->bytes = 0;
+  bitmap_zero(alone, VTFS_HTTP_BATCH_MAX);
+
+  for (size_t i = 0; i < count; i++) {
+    if (!nifs_writeback_batch_add(batch, files[i])) {
+      __set_bit(i, alone);
+    }
+  }
+
+  nifs_writeback_batch_send(sbi, batch);
+  kvfree(batch);
+
+  for (size_t i = 0; i < count; i++) {
+    if (test_bit(i, alone)) {
+      nifs_writeback_flush_file(files[i]);
+    }
+  }
+}
+
+// Uploads files whose data has been dirty for longer than dirty_expire, or
+// every dirty file while more than dirty_limit bytes are dirty
+static void nifs_writeback_work(struct work_struct* work) {
+  struct nifs_sb_info* sbi = container_of(to_delayed_work(work), struct nifs_sb_info, flush_work);
+  unsigned long start = jiffies;  // Files requeued by this pass wait for the next one
+  struct nifs_file_data* files[VTFS_HTTP_BATCH_MAX];
+  struct nifs_file_data* fd;
+  bool flushed = false;
+
+  for (;;) {
+    bool over_limit = atomic_long_read(&sbi->dirty_bytes) > sbi->dirty_limit;
+    size_t count = 0;
+
+    spin_lock(&sbi->dirty_lock);
+    list_for_each_entry(fd, &sbi->dirty_files, dirty_node) {
+      if (count == ARRAY_SIZE(files) || !time_before(fd->dirtied_when, start) ||
+          (!over_limit && time_before(jiffies, fd->dirtied_when + sbi->dirty_expire))) {
+        break;
+      }
+      files[count++] = nifs_get_file_data(fd);
+    }
+    if (!count) {
+      break;
+    }
+    spin_unlock(&sbi->dirty_lock);
+
+    nifs_writeback_flush_files(sbi, files, count);
+    for (size_t i = 0; i < count; i++) {
+      nifs_put_file_data(files[i]);
+    }
+    flushed = true;
+  }
+
+  // Come back when the oldest remaining file expires
+  fd = list_first_entry_or_null(&sbi->dirty_files, struct nifs_file_data, dirty_node);
+  if (fd) {
+    long delay = (long)(fd->dirtied_when + sbi->dirty_expire - jiffies);
+    queue_delayed_work(system_unbound_wq, &sbi->flush_work, max(delay, 1L));
+  }
+  spin_unlock(&sbi->dirty_lock);
+
+  // What was just uploaded can be evicted now
+  if (flushed && nifs_cache_over_limit(sbi)) {
+    queue_work(system_unbound_wq, &sbi->reclaim_work);
+  }
+}
+
+// Forgets the dirty data of fd without uploading it, once an upload in flight
+// is done. Called at unmount for what failed to upload, and when the last link
+// goes: from then on the data of an unlinked file stays in memory only, and
+// nifs_file_data_evict leaves it alone.
+static void nifs_writeback_discard(struct nifs_file_data* fd) {
+  struct nifs_sb_info* sbi = fd->sbi;
+  struct nifs_dirty_range* range;
+  struct nifs_dirty_range* tmp;
+  bool put = false;
+
+  if (!sbi->writeback) {
+    return;
+  }
+
+  mutex_lock(&fd->flush_lock);
+  down_write(&fd->lock);
+
+  list_for_each_entry_safe(range, tmp, &fd->dirty_ranges, node) {
+    list_del(&range->node);
+    kfree(range);
+  }
+  atomic_long_sub(fd->dirty_bytes, &sbi->dirty_bytes);
+  fd->dirty_bytes = 0;
+  fd->size_dirty = false;
+
+  spin_lock(&sbi->dirty_lock);
+  if (!list_empty(&fd->dirty_node)) {
+    list_del_init(&fd->dirty_node);
+    put = true;
+  }
+  spin_unlock(&sbi->dirty_lock);
+
+  up_write(&fd->lock);
+  mutex_unlock(&fd->flush_lock);
+  wake_up_all(&sbi->dirty_wait);
+
+  if (put) {
+    nifs_put_file_data(fd);
+  }
+}
+
+// Final upload at unmount. Whatever still fails is dropped.
+static void nifs_writeback_stop(struct nifs_sb_info* sbi) {
+  struct nifs_file_data* fd;
+
+  cancel_delayed_work_sync(&sbi->flush_work);
+
+  for (;;) {
+    spin_lock(&sbi->dirty_lock);
+    fd = list_first_entry_or_null(&sbi->dirty_files, struct nifs_file_data, dirty_node);
+    if (fd) {
+      nifs_get_file_data(fd);
+    }
+    spin_unlock(&sbi->dirty_lock);
+    if (!fd) {
+      break;
+    }
+
+    if (nifs_writeback_flush_file(fd)) {
+      LOG("Dropping %zu dirty bytes of inode %lu\n", fd->dirty_bytes, fd->inode_number);
+      nifs_writeback_discard(fd);
+    }
+    nifs_put_file_data(fd);
+  }
+
+  cancel_delayed_work_sync(&sbi->flush_work);  // In case a failed upload requeued it
+}
+
+// ====== ========== ======
+
+// ====== MEMORY BUDGET ======
+
+// Gives back up to nr clean pages of fd, leaving NIFS_REMOTE_PAGE stand-ins to
+// be fetched again when next needed. Files busy being read, written or
+// uploaded are skipped. Returns the number of pages freed.
+static long nifs_file_data_evict(struct nifs_file_data* fd, long nr) {
+  struct nifs_dirty_range* range;
+  struct page* page;
+  ulong index;
+  long freed = 0;
+
+  // An upload in flight has already taken its ranges off dirty_ranges
+  if (!mutex_trylock(&fd->flush_lock)) {
+    return 0;
+  }
+  if (!down_write_trylock(&fd->lock)) {
+    mutex_unlock(&fd->flush_lock);
+    return 0;
+  }
+
+  // The backend still has the bytes past a shrunk EOF, a refetch would bring them
+  // back. An unlinked file isn't tracked at all and must keep every page.
+  if (fd->size_dirty || !fd->nlink) {
+    goto out;
+  }
+
+  range = list_first_entry_or_null(&fd->dirty_ranges, struct nifs_dirty_range, node);
+  xa_for_each(&fd->pages, index, page) {
+    loff_t start = (loff_t)index << PAGE_SHIFT;
+
+    if (freed >= nr) {
+      break;
+    }
+    if (xa_is_value(page)) {
+      continue;
+    }
+
+    while (range && range->end <= start) {
+      range = list_is_last(&range->node, &fd->dirty_ranges) ? NULL : list_next_entry(range, node);
+    }
+    if (range && range->start < start + PAGE_SIZE) {
+      continue;  // Not uploaded yet
+    }
+
+    xa_store(&fd->pages, index, NIFS_REMOTE_PAGE, GFP_NOWAIT);  // Replaces in place, can't fail
+    __free_page(page);
+    freed++;
+  }
+  if (freed) {
+    fd->gen++;  // Prefetches in flight may predate an upload of these pages
+  }
+
+out:
+  up_write(&fd->lock);
+  mutex_unlock(&fd->flush_lock);
+
+  if (freed) {
+    atomic_long_add(freed, &fd->sbi->stats.pages_freed);
+    atomic_long_add(freed, &fd->sbi->stats.pages_evicted);
+    nifs_file_data_charge(fd, -freed);
+  }
+  return freed;
+}
+
+// Evicts up to nr pages with a second-chance clock over the files of the
+// mount that have pages in memory: a file used since the hand last passed it
+// is spared once, an idle one gives back all its clean pages. The hand moves
+// at most scan files, and around the clock twice. Returns the number of pages
+// freed.
+static long nifs_cache_evict(struct nifs_sb_info* sbi, long nr, unsigned long scan) {
+  long freed = 0;
+
+  spin_lock(&sbi->lru_lock);
+  scan = min(scan, 2 * sbi->lru_files);
+
+  for (; scan && freed < nr && !list_empty(&sbi->lru); scan--) {
+    struct nifs_file_data* fd = list_first_entry(&sbi->lru, struct nifs_file_data, lru_node);
+    list_move_tail(&fd->lru_node, &sbi->lru);
+
+    if (READ_ONCE(fd->lru_referenced)) {
+      WRITE_ONCE(fd->lru_referenced, false);
+      cond_resched_lock(&sbi->lru_lock);
+      continue;
+    }
+    if (!nifs_tryget_file_data(fd)) {
+      continue;  // Being freed
+    }
+    spin_unlock(&sbi->lru_lock);
+
+    freed += nifs_file_data_evict(fd, nr - freed);
+    nifs_put_file_data(fd);
+
+    spin_lock(&sbi->lru_lock);
+  }
+
+  spin_unlock(&sbi->lru_lock);
+  return freed;
+}
+
+// Evicts down to a bit under cache_bytes, so that the next few pages don't
+// start reclaim all over again. Dirty data can't go before it is uploaded:
+// if that's what keeps the mount over budget, the flusher is started early.
+static void nifs_cache_reclaim_work(struct work_struct* work) {
+  struct nifs_sb_info* sbi = container_of(work, struct nifs_sb_info, reclaim_work);
+  long limit = sbi->cache_limit >> PAGE_SHIFT;
+  long excess = atomic_long_read(&sbi->cache_pages) - (limit - limit / 16);
+
+  if (excess > 0 && nifs_cache_evict(sbi, excess, ULONG_MAX) < excess &&
+      atomic_long_read(&sbi->dirty_bytes)) {
+    mod_delayed_work(system_unbound_wq, &sbi->flush_work, 0);
+  }
+}
+
+static unsigned long nifs_cache_count(struct shrinker* shrinker, struct shrink_control* sc) {
+  struct nifs_sb_info* sbi = shrinker->private_data;
+  long clean = atomic_long_read(&sbi->cache_pages) -
+               (atomic_long_read(&sbi->dirty_bytes) >> PAGE_SHIFT);
+
+  return max(clean, 0L);
+}
+
+static unsigned long nifs_cache_scan(struct shrinker* shrinker, struct shrink_control* sc) {
+  struct nifs_sb_info* sbi = shrinker->private_data;
+
+  if (!(sc->gfp_mask & __GFP_FS)) {
+    return SHRINK_STOP;
+  }
+
+  long freed = nifs_cache_evict(sbi, sc->nr_to_scan, sc->nr_to_scan);
+  return freed ? freed : SHRINK_STOP;
+}
+
+// Lets memory pressure evict clean file data. Without write-back the backend
+// has no copy of it, so there is nothing the shrinker could give back.
+static int nifs_cache_register_shrinker(struct super_block* sb) {
+  struct nifs_sb_info* sbi = NIFS_SB(sb);
+
+  if (!sbi->writeback) {
+    return 0;
+  }
+
+  sbi->shrinker = shrinker_alloc(0, "nifs-%s", sb->s_id);
+  if (!sbi->shrinker) {
+    return -ENOMEM;
+  }
+
+  sbi->shrinker->count_objects = nifs_cache_count;
+  sbi->shrinker->scan_objects = nifs_cache_scan;
+  sbi->shrinker->private_data = sbi;
+  shrinker_register(sbi->shrinker);
+  return 0;
+}
+
+// ====== ============= ======
+
+// ====== FILE OPERATIONS ======
+
+// File data lives in the store, struct nifs_file_data. The page cache on top of
+// it holds clean copies for buffered I/O, splice and mmap, so cached data takes
+// memory twice: once pinned in the store, counted against cache_bytes, and once
+// in folios the kernel reclaims like any clean page cache. The latter shows as
+// pagecache_pages in /proc/self/mountstats. Holes are read without a folio, see
+// nifs_file_read_iter, and only folios dirtied through a mapping differ from the
+// store until written back.
+
+// Fills folio from file data, zeroing whatever lies past EOF
+static int nifs_fill_folio(struct nifs_file_data* data, struct folio* folio) {
+  struct bio_vec bvec;
+  struct iov_iter iter;
+
+  bvec_set_folio(&bvec, folio, folio_size(folio), 0);
+  iov_iter_bvec(&iter, ITER_DEST, &bvec, 1, folio_size(folio));
+
+  ssize_t copied = nifs_file_data_read_iter(data, folio_pos(folio), &iter);
+  if (copied < 0) {
+    return copied;
+  }
+  folio_zero_range(folio, copied, folio_size(folio) - copied);
+  folio_mark_uptodate(folio);
+  return 0;
+}
+
+static int nifs_read_folio(struct file* filp, struct folio* folio) {
+  struct nifs_file_data* data = folio->mapping->host->i_private;
+
+  int ret = nifs_fill_folio(data, folio);
+  folio_unlock(folio);
+  return ret;
+}
+
+static int nifs_write_begin(
+    struct file* filp,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    struct folio** foliop,
+    void** fsdata
+) {
+  struct nifs_file_data* data = mapping->host->i_private;
+
+  int ret = nifs_writeback_throttle(data->sbi);
+  if (ret) {
+    return ret;
+  }
+
+  struct folio* folio = __filemap_get_folio(
+      mapping, pos >> PAGE_SHIFT, FGP_WRITEBEGIN, mapping_gfp_mask(mapping)
+  );
+  if (IS_ERR(folio)) {
+    return PTR_ERR(folio);
+  }
+
+  // A partial write must not lose the rest of the folio
+  if (!folio_test_uptodate(folio) && len != folio_size(folio)) {
+    ret = nifs_fill_folio(data, folio);
+    if (ret) {
+      folio_unlock(folio);
+      folio_put(folio);
+      return ret;
+    }
+  }
+
+  *foliop = folio;
+  return 0;
+}
+
+static int nifs_write_end(
+    struct file* filp,
+    struct address_space* mapping,
+    loff_t pos,
+    unsigned int len,
+    unsigned int copied,
+    struct folio* folio,
+    void* fsdata
+) {
+  struct inode* inode = mapping->host;
+  struct nifs_file_data* data = inode->i_private;
+  struct bio_vec bvec;
+  struct iov_iter iter;
+  pgoff_t index = folio->index;
+  bool stale = false;
+  int ret = copied;
+
+  if (!folio_test_uptodate(folio)) {
+    if (copied < len) {
+      ret = 0;  // Short copy into a fresh folio, let generic_perform_write retry
+      goto out;
+    }
+    folio_mark_uptodate(folio);
+  }
+
+  bvec_set_folio(&bvec, folio, copied, offset_in_folio(folio, pos));
+  iov_iter_bvec(&iter, ITER_SOURCE, &bvec, 1, copied);
+
+  ssize_t written = nifs_file_data_write_iter(data, pos, &iter, true);
+  if (written < copied) {
+    // The folio holds bytes the store didn't take. Unless a mapping dirtied it
+    // too, it's dropped below and read back from the store next time.
+    if (!folio_test_dirty(folio)) {
+      folio_clear_uptodate(folio);
+      stale = true;
+    }
+    ret = written;
+    if (written <= 0) {
+      goto out;
+    }
+  }
+
+  if (pos + written > inode->i_size) {
+    i_size_write(inode, pos + written);
+  }
+
+out:
+  folio_unlock(folio);
+  folio_put(folio);
+
+  if (stale) {
+    invalidate_inode_pages2_range(mapping, index, index);
+  }
+  return ret;
+}
+
+// Copies a folio dirtied through a shared mapping into file data. Mapped writes
+// can't extend the file: a folio truncated meanwhile only keeps what's below EOF.
+static int nifs_write_folio(struct nifs_file_data* data, struct folio* folio) {
+  struct bio_vec bvec;
+  struct iov_iter iter;
+  loff_t pos = folio_pos(folio);
+
+  folio_start_writeback(folio);
+
+  bvec_set_folio(&bvec, folio, folio_size(folio), 0);
+  iov_iter_bvec(&iter, ITER_SOURCE, &bvec, 1, folio_size(folio));
+
+  ssize_t written = nifs_file_data_write_iter(data, pos, &iter, false);
+  if (written < 0) {
+    mapping_set_error(folio->mapping, written);
+  }
+
+  folio_unlock(folio);
+  folio_end_writeback(folio);
+  return written < 0 ? written : 0;
+}
+
+static int nifs_writepages(struct address_space* mapping, struct writeback_control* wbc) {
+  struct nifs_file_data* data = mapping->host->i_private;
+  struct folio* folio = NULL;
+  int error = 0;
+
+  while ((folio = writeback_iter(mapping, wbc, folio, &error))) {
+    error = nifs_write_folio(data, folio);
+  }
+  return error;
+}
+
+// Mapped writes must not dirty a folio while a hole is punched under it, or
+// writeback would put the punched data back. filemap_fault needs no wrapper:
+// it already holds invalidate_lock shared while it reads folios in.
+static vm_fault_t nifs_page_mkwrite(struct vm_fault* vmf) {
+  struct inode* inode = file_inode(vmf->vma->vm_file);
+  struct folio* folio = page_folio(vmf->page);
+  vm_fault_t ret = VM_FAULT_LOCKED;
+
+  sb_start_pagefault(inode->i_sb);
+  file_update_time(vmf->vma->vm_file);
+  filemap_invalidate_lock_shared(inode->i_mapping);
+
+  folio_lock(folio);
+  if (folio->mapping != inode->i_mapping) {
+    folio_unlock(folio);  // Punched or truncated meanwhile
+    ret = VM_FAULT_NOPAGE;
+    goto out;
+  }
+  folio_mark_dirty(folio);
+  folio_wait_stable(folio);
+
+out:
+  filemap_invalidate_unlock_shared(inode->i_mapping);
+  sb_end_pagefault(inode->i_sb);
+  return ret;
+}
+
+static const struct vm_operations_struct nifs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = nifs_page_mkwrite,
+};
+
+static int nifs_file_mmap(struct file* filp, struct vm_area_struct* vma) {
+  file_accessed(filp);
+  vma->vm_ops = &nifs_file_vm_ops;
+  return 0;
+}
+
+static loff_t nifs_llseek(struct file* filp, loff_t offset, int whence) {
+  struct inode* inode = file_inode(filp);
+
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    return generic_file_llseek(filp, offset, whence);
+  }
+
+  inode_lock_shared(inode);
+
+  // Data written through a shared mapping is only in the store once written back
+  int ret = filemap_write_and_wait(inode->i_mapping);
+  if (ret) {
+    inode_unlock_shared(inode);
+    return ret;
+  }
+  offset = nifs_file_data_seek(inode->i_private, offset, whence);
+
+  inode_unlock_shared(inode);
+
+  if (offset < 0) {
+    return offset;
+  }
+  return vfs_setpos(filp, offset, inode->i_sb->s_maxbytes);
+}
+
+// Preallocation only moves the size: pages are allocated when first written
+static long nifs_fallocate(struct file* filp, int mode, loff_t offset, loff_t len) {
+  struct inode* inode = file_inode(filp);
+  struct nifs_file_data* data = inode->i_private;
+  loff_t end = offset + len;
+  long ret = 0;
+
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+    return -EOPNOTSUPP;
+  }
+
+  inode_lock(inode);
+
+  if (mode & FALLOC_FL_PUNCH_HOLE) {
+    // Keeps faults from reading the old data back in before the punch lands
+    filemap_invalidate_lock(inode->i_mapping);
+    truncate_pagecache_range(inode, offset, end - 1);
+    ret = nifs_file_data_punch_hole(data, offset, len);
+    filemap_invalidate_unlock(inode->i_mapping);
+  } else if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+    ret = inode_newsize_ok(inode, end);
+    if (!ret) {
+      ret = nifs_resize_file_data(data, end);
+    }
+    if (!ret) {
+      i_size_write(inode, end);
+    }
+  }
+
+  if (!ret) {
+    inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+  }
+
+  inode_unlock(inode);
+  return ret;
+}
+
+// Both only wait for the dirty data of this file, not the whole mount. Folios
+// dirtied through mappings only get there once written back from the page cache.
+static int nifs_fsync(struct file* filp, loff_t start, loff_t end, int datasync) {
+  int ret = file_write_and_wait_range(filp, start, end);
+  if (ret) {
+    return ret;
+  }
+  return nifs_writeback_flush_file(file_inode(filp)->i_private);
+}
+
+static int nifs_open(struct inode* inode, struct file* filp) {
+  filp->f_mode |= FMODE_CAN_ODIRECT;
+  return simple_open(inode, filp);
+}
+
+// Buffered reads go through the page cache, except over holes of the store
+// that have no folio cached either: those read as zeros without filling the
+// page cache with zero folios.
+static ssize_t nifs_file_read_cached(struct kiocb* iocb, struct iov_iter* to) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  struct nifs_file_data* data = inode->i_private;
+  bool cached = false;
+  ssize_t read = 0;
+
+  while (iov_iter_count(to)) {
+    loff_t pos = iocb->ki_pos;
+    loff_t size = i_size_read(inode);
+    size_t count = iov_iter_count(to);
+
+    if (pos >= size) {
+      break;
+    }
+
+    // Extent at pos up to where the store switches between data and hole
+    bool hole;
+    loff_t end = nifs_file_data_extent(data, pos, min_t(loff_t, size, pos + count), &hole);
+    size_t len = max_t(loff_t, end - pos, 0);
+
+    if (!len) {
+      break;
+    }
+    if (hole && !filemap_range_has_page(inode->i_mapping, pos, pos + len - 1)) {
+      size_t zeroed = iov_iter_zero(len, to);
+      iocb->ki_pos += zeroed;
+      read += zeroed;
+      if (zeroed < len) {
+        return read ? read : -EFAULT;
+      }
+      continue;
+    }
+
+    iov_iter_truncate(to, len);
+    ssize_t ret = generic_file_read_iter(iocb, to);
+    cached = true;
+    iov_iter_reexpand(to, iov_iter_count(to) + count - len);
+    if (ret <= 0) {
+      return read ? read : ret;
+    }
+    read += ret;
+    if (ret < len) {
+      break;
+    }
+  }
+
+  if (!cached) {
+    file_accessed(iocb->ki_filp);  // Done by generic_file_read_iter otherwise
+  }
+  return read;
+}
+
+// O_DIRECT reads and writes skip the page cache and copy straight between the
+// user buffers and file data, the whole iov_iter under one lock. Cached folios
+// over the range are written back first, and dropped before and after a write.
+static ssize_t nifs_file_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  size_t count = iov_iter_count(to);
+
+  if (!(iocb->ki_flags & IOCB_DIRECT)) {
+    return nifs_file_read_cached(iocb, to);
+  }
+  if (!count) {
+    return 0;
+  }
+
+  inode_lock_shared(inode);
+  ssize_t ret = filemap_write_and_wait_range(
+      inode->i_mapping, iocb->ki_pos, iocb->ki_pos + count - 1
+  );
+  if (!ret) {
+    ret = nifs_file_data_read_iter(inode->i_private, iocb->ki_pos, to);
+  }
+  if (ret > 0) {
+    iocb->ki_pos += ret;
+  }
+  inode_unlock_shared(inode);
+
+  file_accessed(iocb->ki_filp);
+  return ret;
+}
+
+static ssize_t nifs_file_write_iter(struct kiocb* iocb, struct iov_iter* from) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  struct nifs_file_data* data = inode->i_private;
+
+  if (!(iocb->ki_flags & IOCB_DIRECT)) {
+    return generic_file_write_iter(iocb, from);
+  }
+
+  inode_lock(inode);
+
+  ssize_t ret = generic_write_checks(iocb, from);
+  if (ret <= 0) {
+    goto out;
+  }
+  ret = file_modified(iocb->ki_filp);
+  if (ret) {
+    goto out;
+  }
+  ret = nifs_writeback_throttle(data->sbi);
+  if (ret) {
+    goto out;
+  }
+  ret = kiocb_invalidate_pages(iocb, iov_iter_count(from));
+  if (ret) {
+    goto out;
+  }
+
+  loff_t pos = iocb->ki_pos;
+  ret = nifs_file_data_write_iter(data, pos, from, true);
+  if (ret > 0) {
+    // Buffered readers don't take inode_lock and may have cached the old data meanwhile
+    kiocb_invalidate_post_direct_write(iocb, ret);
+    iocb->ki_pos = pos + ret;
+    if (iocb->ki_pos > i_size_read(inode)) {
+      i_size_write(inode, iocb->ki_pos);
+    }
+  }
+
+out:
+  inode_unlock(inode);
+  if (ret > 0) {
+    ret = generic_write_sync(iocb, ret);
+  }
+  return ret;
+}
+
+static int nifs_flush(struct file* filp, fl_owner_t id) {
+  if (!(filp->f_mode & FMODE_WRITE)) {
+    return 0;
+  }
+  return nifs_writeback_flush_file(file_inode(filp)->i_private);
+}
+
+static int nifs_setattr(struct mnt_idmap* idmap, struct dentry* dentry, struct iattr* iattr) {
+  struct inode* inode = d_inode(dentry);
+
+  int ret = setattr_prepare(idmap, dentry, iattr);
+  if (ret) {
+    return ret;
+  }
+
+  // Shrinking gives the pages past the new EOF back, both cached and stored
+  if ((iattr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode)) {
+    ret = nifs_resize_file_data(inode->i_private, iattr->ia_size);
+    if (ret) {
+      return ret;
+    }
+    truncate_setsize(inode, iattr->ia_size);
+  }
+
+  setattr_copy(idmap, inode, iattr);
+  mark_inode_dirty(inode);
+  return 0;
+}
+
+// Directory size and link count come straight from its index, so a stat
+// always matches what readdir would list
+static int nifs_getattr(
+    struct mnt_idmap* idmap,
+    const struct path* path,
+    struct kstat* stat,
+    u32 request_mask,
+    unsigned int query_flags
+) {
+  struct inode* inode = d_inode(path->dentry);
+
+  generic_fillattr(idmap, request_mask, inode, stat);
+
+  if (S_ISDIR(inode->i_mode)) {
+    rcu_read_lock();
+    struct nifs_dir_entry* dir = nifs_find_directory(NIFS_SB(inode->i_sb), inode->i_ino);
+    if (dir) {
+      nifs_dir_counts(dir, &stat->size, &stat->nlink);
+    }
+    rcu_read_unlock();
+  }
+  return 0;
+}
+
+static int nifs_link(
+    struct dentry* old_dentry, struct inode* parent_dir, struct dentry* new_dentry
+) {
+  const char* new_name = new_dentry->d_name.name;
+  struct inode* target_inode = d_inode(old_dentry);
+  struct nifs_dir_entry* parent_dir_entry;
+
+  LOG("Creating hard link: %s -> %s (inode %lu)\n",
+      new_name,
+      old_dentry->d_name.name,
+      target_inode->i_ino);
+
+  if (S_ISDIR(target_inode->i_mode)) {
+    return -EPERM;
+  }
+
+  struct nifs_file_data* source_data = target_inode->i_private;
+
+  parent_dir_entry = nifs_find_directory(NIFS_SB(parent_dir->i_sb), parent_dir->i_ino);
+  if (!parent_dir_entry) {
+    return -ENOENT;
+  }
+
+  struct nifs_file_entry* new_entry = nifs_alloc_file_entry(new_name);
+  if (!new_entry) {
+    return -ENOMEM;
+  }
+
+  // 6. Set new entry's data pointer to the source inode's data
+  new_entry->data = source_data;
+
+  // 7. Set new entry's inode_number to the source's inode_number
+  new_entry->inode_number = target_inode->i_ino;
+  new_entry->parent_inode = parent_dir->i_ino;
+
+  // 8. Add to parent directory
+  down_write(&parent_dir_entry->lock);
+  int ret = -EEXIST;
+  if (!nifs_find_file_in_dir(parent_dir_entry, new_name) &&
+      !nifs_find_subdir(parent_dir_entry, new_name)) {
+    ret = nifs_dir_add_file(parent_dir_entry, new_entry);
+  }
+  up_write(&parent_dir_entry->lock);
+  if (ret) {
+    nifs_free_file_entry(new_entry);
+    return ret;
+  }
+
+  // 9. Count the link on both the data and the inode
+  nifs_get_file_data(source_data);
+  down_write(&source_data->lock);
+  source_data->nlink++;
+  up_write(&source_data->lock);
+  inc_nlink(target_inode);
+  inode_set_ctime_current(target_inode);
+  nifs_dir_changed(parent_dir, parent_dir_entry);
+
+  // 10. Link the dentry to the existing inode
+  new_dentry->d_time = jiffies;
+  d_instantiate(new_dentry, igrab(target_inode));
+
+  LOG("Hard link created: %s -> inode %lu (link count: %u)\n",
+      new_name,
+      target_inode->i_ino,
+      target_inode->i_nlink);
+
+  return 0;
+}
+
+// ====== =============== ======
+
+// Readdir-plus: instantiates the dentry and inode of a child being listed, so
+// that the stat() that follows in ls -l or find hits the dcache instead of
+// doing a lookup of its own. Names already in the dcache are left alone.
+// Attributes are in memory, so this only saves a hash lookup per name while
+// growing the dcache and icache by entries a plain ls never uses: it's off
+// unless mounted with readdirplus, meant for a backend that lists remotely.
+static void nifs_prime_dentry(
+    struct dentry* parent, const char* name, ulong ino, umode_t mode, struct nifs_file_data* data
+) {
+  DECLARE_WAIT_QUEUE_HEAD_ONSTACK(wq);
+  struct qstr qname = QSTR_INIT(name, strlen(name));
+
+  qname.hash = full_name_hash(parent, qname.name, qname.len);
+  struct dentry* dentry = d_alloc_parallel(parent, &qname, &wq);
+  if (IS_ERR(dentry)) {
+    return;
+  }
+
+  if (d_in_lookup(dentry)) {
+    struct dentry* alias = NULL;
+    struct inode* inode = nifs_get_inode(parent->d_sb, d_inode(parent), mode, ino, data);
+    if (inode) {
+      dentry->d_time = jiffies;
+      alias = d_splice_alias(inode, dentry);
+    }
+    d_lookup_done(dentry);
+    if (!IS_ERR_OR_NULL(alias)) {
+      dput(alias);
+    }
+  }
+  dput(dentry);
+}
+
+// ctx->pos is "." / ".." and then the cookie of the next child to emit
+static int nifs_iterate(struct file* filp, struct dir_context* ctx) {
+  struct inode* inode = file_inode(filp);
+
+  struct nifs_dir_entry* dir = nifs_find_directory(NIFS_SB(inode->i_sb), inode->i_ino);
+  if (!dir) {
+    return 0;
+  }
+
+  if (!dir_emit_dots(filp, ctx)) {
+    return 0;
+  }
+
+  // Entries may go away once the RCU read section ends, and dir_emit() can fault,
+  // so each one is copied out first
+  char name[NAME_MAX + 1];
+
+  for (;;) {
+    ulong cookie = ctx->pos;
+    ulong ino;
+    unsigned char type;
+    struct nifs_file_data* data = NULL;
+
+    rcu_read_lock();
+    void* entry = xa_find(&dir->cookies, &cookie, U32_MAX, XA_PRESENT);
+    if (!entry) {
+      rcu_read_unlock();
+      break;
+    }
+
+    if (xa_pointer_tag(entry) == NIFS_INODE_DIR) {
+      struct nifs_dir_entry* subdir = xa_untag_pointer(entry);
+      strscpy(name, subdir->name);
+      ino = subdir->inode_number;
+      type = DT_DIR;
+    } else {
+      struct nifs_file_entry* file = entry;
+      strscpy(name, file->name);
+      ino = file->inode_number;
+      type = DT_REG;
+      data = nifs_tryget_file_data(file->data);
+    }
+    rcu_read_unlock();
+
+    if (NIFS_SB(inode->i_sb)->readdirplus && (type == DT_DIR || data)) {
+      nifs_prime_dentry(filp->f_path.dentry, name, ino, type == DT_DIR ? S_IFDIR : S_IFREG, data);
+    }
+    if (data) {
+      nifs_put_file_data(data);
+    }
+
+    if (!dir_emit(ctx, name, strlen(name), ino, type)) {
+      break;
+    }
+    ctx->pos = cookie + 1;
+  }
+
+  return 0;
+}
+
+// ====== DENTRY CACHE ======
+
+// Brings the attributes of inode up to date with the store. An inode locked by
+// someone else is left alone, since whoever holds it keeps them current.
+static void nifs_refresh_inode(struct inode* inode) {
+  struct nifs_file_data* data = inode->i_private;
+
+  if (!S_ISREG(inode->i_mode) || !inode_trylock(inode)) {
+    return;
+  }
+
+  down_read(&data->lock);
+  loff_t size = data->size;
+  set_nlink(inode, data->nlink);
+  up_read(&data->lock);
+
+  if (size != i_size_read(inode)) {
+    truncate_setsize(inode, size);
+  }
+  inode_unlock(inode);
+}
+
+// A dentry, negative ones included, is trusted for attr_timeout (neg_timeout)
+// after it was last checked. Past that the name is looked up in the directory
+// again and the inode attributes refreshed, but the dentry is only dropped if
+// the name went away or now refers to something else.
+static int nifs_d_revalidate(
+    struct inode* dir, const struct qstr* name, struct dentry* dentry, unsigned int flags
+) {
+  struct nifs_sb_info* sbi = NIFS_SB(dentry->d_sb);
+  struct inode* inode = d_inode_rcu(dentry);
+  unsigned long timeout = inode ? sbi->attr_timeout : sbi->neg_timeout;
+
+  if (time_before(jiffies, READ_ONCE(dentry->d_time) + timeout)) {
+    return 1;
+  }
+  if (flags & LOOKUP_RCU) {
+    return -ECHILD;  // Refreshing may sleep
+  }
+
+  ulong ino = 0;
+
+  rcu_read_lock();
+  struct nifs_dir_entry* parent_dir = nifs_find_directory(NIFS_SB(dir->i_sb), dir->i_ino);
+  // name points into the path being walked and is not NUL-terminated at name->len
+  struct nifs_dir_entry* subdir = nifs_find_subdir_qstr(parent_dir, name);
+  struct nifs_file_entry* file = subdir ? NULL : nifs_find_file_in_dir_qstr(parent_dir, name);
+  if (subdir) {
+    ino = subdir->inode_number;
+  } else if (file) {
+    ino = file->inode_number;
+  }
+  rcu_read_unlock();
+
+  if (inode ? ino != inode->i_ino : ino != 0) {
+    return 0;
+  }
+  if (inode) {
+    nifs_refresh_inode(inode);
+  }
+
+  WRITE_ONCE(dentry->d_time, jiffies);
+  return 1;
+}
+
+static const struct dentry_operations nifs_dentry_ops = {
+    .d_revalidate = nifs_d_revalidate,
+};
+
+// ====== ============ ======
+
+static struct dentry* nifs_lookup(
+    struct inode* parent_inode,  // родительская нода
+    struct dentry* child_dentry,  // объект, к которому мы пытаемся получить доступ
+    unsigned int flag  // неиспользуемое значение
+) {
+  LOG("LOOKUP!");
+  const char* name = child_dentry->d_name.name;
+  struct nifs_sb_info* sbi = NIFS_SB(parent_inode->i_sb);
+  struct nifs_dir_entry* parent_dir = nifs_find_directory(sbi, parent_inode->i_ino);
 
   if (!parent_dir) {
     d_add(child_dentry, NULL);
@@ -581,7 +2982,7 @@ static struct dentry* nifs_lookup(
   }
 
   if (!strcmp(name, "..")) {
-    struct nifs_dir_entry* grandparent = nifs_find_directory(parent_dir->parent_inode);
+    struct nifs_dir_entry* grandparent = nifs_find_directory(sbi, parent_dir->parent_inode);
     if (grandparent) {
       struct inode* inode = ilookup(parent_inode->i_sb, grandparent->inode_number);
       if (inode) {
@@ -593,51 +2994,212 @@ static struct dentry* nifs_lookup(
     return NULL;
   }
 
+  struct inode* inode = NULL;
+  struct nifs_file_data* data = NULL;
+  ulong ino = 0;
+  umode_t mode = 0;
+
+  // Lockless: only the inode number and a data reference leave the read section,
+  // since creating the inode may sleep
+  rcu_read_lock();
+
   struct nifs_dir_entry* subdir = nifs_find_subdir(parent_dir, name);
   if (subdir) {
-    struct inode* inode =
-        nifs_get_inode(parent_inode->i_sb, parent_inode, S_IFDIR, subdir->inode_number);
-    if (inode) {
-      d_add(child_dentry, inode);
-      return NULL;
-    }
+    ino = subdir->inode_number;
+    mode = S_IFDIR;
   }
 
-  struct nifs_file_entry* file = nifs_find_file_in_dir(parent_dir, name);
+  struct nifs_file_entry* file = subdir ? NULL : nifs_find_file_in_dir(parent_dir, name);
   if (file) {
-    struct inode* inode =
-        nifs_get_inode(parent_inode->i_sb, parent_inode, S_IFREG, file->inode_number);
-    if (inode) {
-      d_add(child_dentry, inode);
-      return NULL;
+    data = nifs_tryget_file_data(file->data);
+    if (data) {
+      ino = file->inode_number;
+      mode = S_IFREG;
+    }
+  }
+
+  rcu_read_unlock();
+
+  if (ino) {
+    inode = nifs_get_inode(parent_inode->i_sb, parent_inode, mode, ino, data);
+  }
+  if (data) {
+    nifs_put_file_data(data);  // The inode holds its own reference
+  }
+
+  // A cached directory inode may still have an alias, e.g. a dentry dropped by
+  // nifs_d_revalidate while someone's cwd
+  child_dentry->d_time = jiffies;  // Negative ones are cached too, see nifs_d_revalidate
+  return d_splice_alias(inode, child_dentry);
+}
+
+// What nifs_mount hands to nifs_fill_super through mount_nodev()
+struct nifs_mount_args {
+  const char* token;
+  void* data;
+};
+
+enum {
+  NIFS_OPT_WRITEBACK,
+  NIFS_OPT_DIRTY_EXPIRE,
+  NIFS_OPT_DIRTY_BYTES,
+  NIFS_OPT_CACHE_BYTES,
+  NIFS_OPT_ATTR_TIMEOUT,
+  NIFS_OPT_NEG_TIMEOUT,
+  NIFS_OPT_READDIRPLUS,
+  NIFS_OPT_ERR,
+};
+
+static const match_table_t nifs_tokens = {
+    {NIFS_OPT_WRITEBACK, "writeback"},
+    {NIFS_OPT_DIRTY_EXPIRE, "dirty_expire_ms=%u"},
+    {NIFS_OPT_DIRTY_BYTES, "dirty_bytes=%u"},
+    {NIFS_OPT_CACHE_BYTES, "cache_bytes=%u"},
+    {NIFS_OPT_ATTR_TIMEOUT, "attr_timeout_ms=%u"},
+    {NIFS_OPT_NEG_TIMEOUT, "neg_timeout_ms=%u"},
+    {NIFS_OPT_READDIRPLUS, "readdirplus"},
+    {NIFS_OPT_ERR, NULL},
+};
+
+static int nifs_parse_options(struct nifs_sb_info* sbi, char* options) {
+  substring_t args[MAX_OPT_ARGS];
+  char* option;
+
+  while ((option = strsep(&options, ",")) != NULL) {
+    unsigned int msecs;
+    u64 bytes;
+
+    if (!*option) {
+      continue;
+    }
+
+    switch (match_token(option, nifs_tokens, args)) {
+      case NIFS_OPT_WRITEBACK:
+        sbi->writeback = true;
+        break;
+      case NIFS_OPT_DIRTY_EXPIRE:
+        if (match_uint(&args[0], &msecs) || !msecs) {
+          return -EINVAL;
+        }
+        sbi->dirty_expire = msecs_to_jiffies(msecs);
+        break;
+      case NIFS_OPT_DIRTY_BYTES:
+        if (match_u64(&args[0], &bytes)) {
+          return -EINVAL;
+        }
+        sbi->dirty_limit = bytes;
+        break;
+      case NIFS_OPT_CACHE_BYTES:
+        if (match_u64(&args[0], &bytes)) {
+          return -EINVAL;
+        }
+        sbi->cache_limit = bytes;
+        break;
+      case NIFS_OPT_ATTR_TIMEOUT:
+        if (match_uint(&args[0], &msecs)) {
+          return -EINVAL;
+        }
+        sbi->attr_timeout = msecs_to_jiffies(msecs);  // 0 checks on every lookup
+        break;
+      case NIFS_OPT_NEG_TIMEOUT:
+        if (match_uint(&args[0], &msecs)) {
+          return -EINVAL;
+        }
+        sbi->neg_timeout = msecs_to_jiffies(msecs);
+        break;
+      case NIFS_OPT_READDIRPLUS:
+        sbi->readdirplus = true;
+        break;
+      default:
+        LOG("Unknown mount option: %s\n", option);
+        return -EINVAL;
     }
   }
 
-  d_add(child_dentry, NULL);
-  return NULL;
+  // Evicted data is fetched back from the backend, which only has it with write-back
+  if (sbi->cache_limit && !sbi->writeback) {
+    LOG("cache_bytes requires writeback\n");
+    return -EINVAL;
+  }
+  return 0;
 }
 
 static int nifs_fill_super(struct super_block* sb, void* data, int silent) {
-  struct nifs_dir_entry* root_dir = kmalloc(sizeof(struct nifs_dir_entry), GFP_KERNEL);
+  struct nifs_mount_args* args = data;
+
+  struct nifs_sb_info* sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+  if (!sbi) {
+    return -ENOMEM;
+  }
+  sb->s_fs_info = sbi;  // Freed by nifs_kill_sb, even if we fail below
+  xa_init(&sbi->inodes);
+  atomic_long_set(&sbi->next_inode, NIFS_NEXT_INODE);
+
+  int ret = vtfs_http_pool_init(&sbi->http);
+  if (ret) {
+    return ret;
+  }
+
+  sbi->token = kstrdup(args->token ? args->token : "", GFP_KERNEL);
+  if (!sbi->token) {
+    return -ENOMEM;
+  }
+
+  sbi->dirty_expire = NIFS_DIRTY_EXPIRE;
+  sbi->dirty_limit = NIFS_DIRTY_BYTES;
+  atomic_long_set(&sbi->dirty_bytes, 0);
+  spin_lock_init(&sbi->dirty_lock);
+  INIT_LIST_HEAD(&sbi->dirty_files);
+  INIT_DELAYED_WORK(&sbi->flush_work, nifs_writeback_work);
+  init_waitqueue_head(&sbi->dirty_wait);
+
+  atomic_long_set(&sbi->cache_pages, 0);
+  spin_lock_init(&sbi->lru_lock);
+  INIT_LIST_HEAD(&sbi->lru);
+  INIT_WORK(&sbi->reclaim_work, nifs_cache_reclaim_work);
+
+  sbi->attr_timeout = NIFS_ATTR_TIMEOUT;
+  sbi->neg_timeout = NIFS_NEG_TIMEOUT;
+
+  ret = nifs_parse_options(sbi, args->data);
+  if (ret) {
+    return ret;
+  }
+
+  ret = nifs_cache_register_shrinker(sb);
+  if (ret) {
+    return ret;
+  }
+
+  struct nifs_dir_entry* root_dir = nifs_alloc_dir_entry("");  // NO NAME FOR ROOT
   if (!root_dir) {
     return -ENOMEM;
   }
 
-  root_dir->name = kstrdup("", GFP_KERNEL);  // NO NAME FOR ROOT
   root_dir->inode_number = NIFS_ROOT_INODE;
   root_dir->parent_inode = 0;  // NO PARENT FOR ROOT (sad)
-  INIT_LIST_HEAD(&root_dir->files);
-  INIT_LIST_HEAD(&root_dir->subdirs);
-  INIT_LIST_HEAD(&root_dir->parent_list);
-  INIT_LIST_HEAD(&root_dir->global_list);
 
-  list_add_tail(&root_dir->global_list, &nifs_directories);
+  ret = nifs_index_directory(sbi, root_dir);
+  if (ret) {
+    nifs_free_dir_entry(root_dir);
+    return ret;
+  }
+
+  sb->s_op = &nifs_super_ops;
+  sb->s_d_op = &nifs_dentry_ops;
+  sb->s_maxbytes = MAX_LFS_FILESIZE;  // Holes cost nothing, so let files be huge
+
+  // The default noop BDI can't write back, which shared writable mappings need
+  ret = super_setup_bdi(sb);
+  if (ret) {
+    return ret;
+  }
 
-  struct inode* inode = nifs_get_inode(sb, NULL, S_IFDIR, NIFS_ROOT_INODE);
+  struct inode* inode = nifs_get_inode(sb, NULL, S_IFDIR, NIFS_ROOT_INODE, NULL);
   sb->s_root = d_make_root(inode);
   if (sb->s_root == NULL) {
-    kfree(root_dir->name);
-    kfree(root_dir);
+    nifs_unindex_inode(sbi, NIFS_ROOT_INODE);
+    nifs_free_dir_entry(root_dir);
     return -ENOMEM;
   }
 
@@ -653,7 +3215,8 @@ static int nifs_fill_super(struct super_block* sb, void* data, int silent) {
 static struct dentry* nifs_mount(
     struct file_system_type* fs_type, int flags, const char* token, void* data
 ) {
-  struct dentry* ret = mount_nodev(fs_type, flags, data, nifs_fill_super);
+  struct nifs_mount_args args = {.token = token, .data = data};
+  struct dentry* ret = mount_nodev(fs_type, flags, &args, nifs_fill_super);
   if (ret == NULL) {
     printk(KERN_ERR "Can't mount file system\n");
   } else {
@@ -663,41 +3226,91 @@ static struct dentry* nifs_mount(
 }
 
 static void nifs_kill_sb(struct super_block* sb) {
-  struct nifs_dir_entry* dir;
-  struct nifs_dir_entry* tmp_dir;
+  void* entry;
+  ulong ino;
 
-  list_for_each_entry_safe(dir, tmp_dir, &nifs_directories, global_list) {
-    struct nifs_file_entry* file;
-    struct nifs_file_entry* tmp_file;
+  kill_anon_super(sb);  // Evicts every inode, dropping their file data references
 
-    list_for_each_entry_safe(file, tmp_file, &dir->files, parent_list) {
-      list_del(&file->parent_list);
-      list_del(&file->global_list);
-      nifs_free_file_data(file->data);
-      kfree(file->name);
-      kfree(file);
-    }
+  struct nifs_sb_info* sbi = NIFS_SB(sb);
+  if (!sbi) {
+    return;
+  }
+
+  if (sbi->token) {
+    shrinker_free(sbi->shrinker);  // Waits for running scans
+    nifs_writeback_stop(sbi);  // Dirty files are still referenced until uploaded
+    vtfs_http_pool_drain(&sbi->http);  // So do prefetches in flight
 
-    list_del(&dir->global_list);
-    if (!list_empty(&dir->parent_list)) {
-      list_del(&dir->parent_list);
+    // Reclaim may kick the flusher, and the flusher reclaim
+    cancel_work_sync(&sbi->reclaim_work);
+    cancel_delayed_work_sync(&sbi->flush_work);
+  }
+
+  // File data is shared between hard links, so it's freed once per inode, not per entry
+  xa_for_each(&sbi->inodes, ino, entry) {
+    if (xa_pointer_tag(entry) == NIFS_INODE_DIR) {
+      struct nifs_dir_entry* dir = xa_untag_pointer(entry);
+      void* child;
+      ulong cookie;
+
+      // Subdirectories are in the inode index themselves
+      xa_for_each(&dir->cookies, cookie, child) {
+        if (xa_pointer_tag(child) != NIFS_INODE_DIR) {
+          nifs_free_file_entry(child);
+        }
+      }
+      nifs_free_dir_entry(dir);
+    } else {
+      nifs_free_file_data(entry);
     }
-    kfree(dir->name);
-    kfree(dir);
   }
+  xa_destroy(&sbi->inodes);
+
+  vtfs_http_pool_destroy(&sbi->http);
+  kfree(sbi->token);
+  kfree(sbi);
 
-  nifs_next_inode = NIFS_NEXT_INODE;
   LOG("nifs super block destroyed\n");
 }
 
+static void nifs_destroy_caches(void) {
+  rcu_barrier();  // Wait for entries still queued for freeing
+  if (nifs_free_wq) {
+    destroy_workqueue(nifs_free_wq);  // Runs the directory entry frees rcu_barrier queued
+  }
+  kmem_cache_destroy(nifs_file_entry_cache);
+  kmem_cache_destroy(nifs_dir_entry_cache);
+  kmem_cache_destroy(nifs_file_data_cache);
+}
+
+static int nifs_create_caches(void) {
+  nifs_file_entry_cache = KMEM_CACHE(nifs_file_entry, SLAB_ACCOUNT);
+  nifs_dir_entry_cache = KMEM_CACHE(nifs_dir_entry, SLAB_ACCOUNT);
+  nifs_file_data_cache = KMEM_CACHE(nifs_file_data, SLAB_ACCOUNT);
+  nifs_free_wq = alloc_workqueue("nifs_free", WQ_UNBOUND, 0);
+
+  if (!nifs_file_entry_cache || !nifs_dir_entry_cache || !nifs_file_data_cache || !nifs_free_wq) {
+    nifs_destroy_caches();
+    return -ENOMEM;
+  }
+  return 0;
+}
+
 static int __init nifs_init(void) {
   LOG("NIFS joined the kernel\n");
-  int err = register_filesystem(&nifs_fs_type);
+  int err = nifs_create_caches();
+  if (err) {
+    LOG("Failed to create slab caches: %d\n", err);
+    return err;
+  }
+
+  err = register_filesystem(&nifs_fs_type);
   if (err == 0) {
     LOG("NIFS file system registered.\n");
     return 0;
   }
   LOG("Failed to register file system: %d\n", err);
+  nifs_destroy_caches();
   return err;
 }
 
@@ -708,6 +3321,7 @@ static void __exit nifs_exit(void) {
   } else {
     LOG("File system unregistered\n");
   }
+  nifs_destroy_caches();
   LOG("NIFS left the kernel\n");
 }
 
@@ -1,8 +1,19 @@
 #ifndef _NIFS_H
 #define _NIFS_H
 
+#include <linux/dcache.h>
 #include <linux/init.h>
+#include <linux/kref.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "http.h"
 
 #define MODULE_NAME "nifs"
 #define LOG(fmt, ...) pr_info("[" MODULE_NAME "]: " fmt, ##__VA_ARGS__)
@@ -23,33 +34,150 @@ extern struct file_system_type nifs_fs_type; // NOLINT
 #define NIFS_DOTDOT_ENTRY   ".."
 #define NIFS_DIR_NAME       "dir"
 
+// Tag of inode index and readdir cookie entries that point to a nifs_dir_entry
+#define NIFS_INODE_DIR      1
+
+// Readdir positions 0 and 1 are "." and ".."; children get cookies from here on
+#define NIFS_FIRST_COOKIE   2
+
+// Default write-back thresholds, see the dirty_expire_ms and dirty_bytes mount options
+#define NIFS_DIRTY_EXPIRE   (30 * HZ)
+#define NIFS_DIRTY_BYTES    (64 << 20)
+
+// Default dentry cache lifetimes, see the attr_timeout_ms and neg_timeout_ms mount options
+#define NIFS_ATTR_TIMEOUT   (3 * HZ)
+#define NIFS_NEG_TIMEOUT    (3 * HZ)
+
+// Bytes a directory entry adds to the size of its directory
+#define NIFS_DIRENT_SIZE    20
+
+struct nifs_sb_info;
+
+// Inode attributes the store keeps while the inode is out of memory
+struct nifs_attrs {
+  umode_t mode;  // 0 until the inode is first evicted
+  kuid_t uid;
+  kgid_t gid;
+  struct timespec64 atime;
+  struct timespec64 mtime;
+  struct timespec64 ctime;
+};
+
+// A range of file data not uploaded to the backend yet
+struct nifs_dirty_range {
+  loff_t start;
+  loff_t end;  // Exclusive
+  struct list_head node;
+};
+
+// Per-inode file object, shared by all hard links to the inode
 struct nifs_file_data {
-  char* data;
+  struct rw_semaphore lock;  // Protects pages, size, nlink and the dirty state
+  struct xarray pages;    // Page index -> struct page holding that part of the file
   size_t size;
-  size_t capacity;
+  unsigned int nlink;     // Directory entries pointing at this inode
+  struct kref refcount;   // One per link plus one per in-core inode, plus one while dirty
+  struct rcu_head rcu;
+  struct nifs_attrs attrs;
+
+  // Write-back
+  ulong inode_number;
+  struct nifs_sb_info* sbi;
+  struct list_head dirty_ranges;  // nifs_dirty_range, sorted and disjoint
+  size_t dirty_bytes;
+  bool size_dirty;                // Resized since the last upload
+  size_t remote_size;             // Largest size the backend may have, see nifs_writeback_grow
+  unsigned long dirtied_when;     // jiffies
+  struct list_head dirty_node;    // In sbi->dirty_files, empty while clean
+  struct mutex flush_lock;        // Serializes uploads of this file
+
+  // Readahead of pages that live on the backend, see nifs_file_data_readahead
+  pgoff_t ra_next;                // Where a sequential reader misses next
+  pgoff_t ra_mark;                // Reading this page prefetches the next window
+  unsigned int ra_pages;          // Current window
+  atomic_t ra_inflight;           // An asynchronous prefetch is running
+  unsigned long gen;              // Bumped on every write and eviction, under lock
+
+  // Eviction of clean pages under the memory budget, see nifs_cache_evict
+  struct list_head lru_node;      // In sbi->lru while write-back is on and lru_pages isn't 0
+  atomic_long_t lru_pages;        // Pages in memory
+  bool lru_referenced;            // Read or written since the clock last passed
 };
 
 struct nifs_file_entry {
-  char* name;                   // File name
+  char* name;                   // File name, points to inline_name when short enough
+  u32 name_hash;                // full_name_hash() of name
   ulong inode_number;           // Inode number
   ulong parent_inode;           // Parent inode number
   struct nifs_file_data* data;  // Pointer to file data
-  struct list_head parent_list; // For parent directory's files list
-  struct list_head global_list; // For global nifs_files list
+  struct rhash_head name_node;  // For parent directory's files index
+  u32 cookie;                   // Readdir position in parent directory
+  struct rcu_head rcu;
+  char inline_name[DNAME_INLINE_LEN];
 };
 
 struct nifs_dir_entry {
   char* name;
+  u32 name_hash;
   ulong inode_number;
   ulong parent_inode;
-  struct list_head files;
-  struct list_head subdirs;
-  struct list_head parent_list;
-  struct list_head global_list;
+  struct rw_semaphore lock;         // Protects the children indexes below
+  struct rhashtable files_index;    // Name -> nifs_file_entry
+  struct rhashtable subdirs_index;  // Name -> nifs_dir_entry
+  struct xarray cookies;            // Readdir cookie -> child entry, dirs tagged NIFS_INODE_DIR
+  u32 next_cookie;
+  struct rhash_head name_node;      // For parent directory's subdirs index
+  u32 cookie;                       // Readdir position in parent directory
+  struct nifs_attrs attrs;
+  struct rcu_work free_work;
+  char inline_name[DNAME_INLINE_LEN];
+};
+
+// Backing store activity of a mount, reported through /proc/self/mountstats
+struct nifs_stats {
+  atomic_long_t pages_allocated;
+  atomic_long_t pages_freed;
+  atomic_long_t pages_fetched;
+  atomic_long_t pages_evicted;
+  atomic_long_t writes;
+};
+
+// Per-mount state, in sb->s_fs_info
+struct nifs_sb_info {
+  struct xarray inodes;        // Inode number -> nifs_dir_entry / nifs_file_data
+  atomic_long_t next_inode;
+  struct nifs_stats stats;
+
+  char* token;                 // Backend token, given as the mount source
+  struct vtfs_http_pool http;  // Keep-alive connections to the backend
+
+  // Write-back of file data to the backend, off unless mounted with "writeback"
+  bool writeback;
+  unsigned long dirty_expire;    // Age after which dirty data is uploaded, in jiffies
+  size_t dirty_limit;            // Dirty bytes above which everything is uploaded
+  atomic_long_t dirty_bytes;
+  spinlock_t dirty_lock;         // Protects dirty_files
+  struct list_head dirty_files;  // nifs_file_data, by dirtied_when
+  struct delayed_work flush_work;
+  wait_queue_head_t dirty_wait;  // Writers throttled over dirty_limit, see nifs_writeback_throttle
+
+  // Memory budget for file data, only enforceable with write-back
+  size_t cache_limit;            // Bytes of file data kept in memory, 0 for no limit
+  atomic_long_t cache_pages;
+  spinlock_t lru_lock;           // Protects lru and lru_files
+  struct list_head lru;          // nifs_file_data, in eviction clock order
+  unsigned long lru_files;
+  struct work_struct reclaim_work;
+  struct shrinker* shrinker;     // Evicts clean file data under memory pressure
+
+  // How long a dentry is trusted before it is looked up again, in jiffies
+  unsigned long attr_timeout;    // Positive dentries, along with the inode attributes
+  unsigned long neg_timeout;     // Negative dentries
+  bool readdirplus;              // Listing a directory instantiates its children, see nifs_iterate
 };
 
-extern struct list_head nifs_directories;
-extern struct list_head nifs_files;
-extern int nifs_next_inode;
+static inline struct nifs_sb_info* NIFS_SB(struct super_block* sb) {
+  return sb->s_fs_info;
+}
 
 #endif
@@ -1,39 +1,216 @@
 #include "nifs_utils.h"
 
-struct nifs_dir_entry* nifs_find_directory(ulong inode) {
-  struct nifs_dir_entry* dir;
-  list_for_each_entry(dir, &nifs_directories, global_list) {
-    if (dir->inode_number == inode) {
-      return dir;
-    }
+#include <linux/dcache.h>
+#include <linux/jhash.h>
+
+// ====== NAME INDEX ======
+
+// Lookups are keyed by a qstr whose hash is nifs_name_hash() of the name.
+// The stored hash is compared before the name itself. Key names are bounded by
+// their len and need not be NUL-terminated.
+
+static u32 nifs_name_key_hashfn(const void* data, u32 len, u32 seed) {
+  const struct qstr* key = data;
+  return jhash_1word(key->hash, seed);
+}
+
+static u32 nifs_file_obj_hashfn(const void* data, u32 len, u32 seed) {
+  const struct nifs_file_entry* file = data;
+  return jhash_1word(file->name_hash, seed);
+}
+
+static int nifs_file_obj_cmpfn(struct rhashtable_compare_arg* arg, const void* obj) {
+  const struct qstr* key = arg->key;
+  const struct nifs_file_entry* file = obj;
+  if (file->name_hash != key->hash) {
+    return 1;
   }
-  return NULL;
+  return strncmp(file->name, key->name, key->len) || file->name[key->len];
 }
 
-struct nifs_file_entry* nifs_find_file_in_dir(struct nifs_dir_entry* dir, const char* name) {
-  if (!dir) {
-    return NULL;
+static u32 nifs_dir_obj_hashfn(const void* data, u32 len, u32 seed) {
+  const struct nifs_dir_entry* dir = data;
+  return jhash_1word(dir->name_hash, seed);
+}
+
+static int nifs_dir_obj_cmpfn(struct rhashtable_compare_arg* arg, const void* obj) {
+  const struct qstr* key = arg->key;
+  const struct nifs_dir_entry* dir = obj;
+  if (dir->name_hash != key->hash) {
+    return 1;
   }
+  return strncmp(dir->name, key->name, key->len) || dir->name[key->len];
+}
+
+static const struct rhashtable_params nifs_files_index_params = {
+    .head_offset = offsetof(struct nifs_file_entry, name_node),
+    .hashfn = nifs_name_key_hashfn,
+    .obj_hashfn = nifs_file_obj_hashfn,
+    .obj_cmpfn = nifs_file_obj_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params nifs_subdirs_index_params = {
+    .head_offset = offsetof(struct nifs_dir_entry, name_node),
+    .hashfn = nifs_name_key_hashfn,
+    .obj_hashfn = nifs_dir_obj_hashfn,
+    .obj_cmpfn = nifs_dir_obj_cmpfn,
+    .automatic_shrinking = true,
+};
+
+u32 nifs_name_hash(const char* name) {
+  return full_name_hash(NULL, name, strlen(name));
+}
 
-  struct nifs_file_entry* file;
-  list_for_each_entry(file, &dir->files, parent_list) {
-    if (strcmp(file->name, name) == 0) {
-      return file;
+// Short names live in the entry itself, dentry-style
+int nifs_init_name(char** name, char* inline_name, const char* src) {
+  size_t len = strlen(src);
+
+  if (len < DNAME_INLINE_LEN) {
+    *name = inline_name;
+  } else {
+    *name = kmalloc(len + 1, GFP_KERNEL);
+    if (!*name) {
+      return -ENOMEM;
     }
   }
-  return NULL;
+
+  memcpy(*name, src, len + 1);
+  return 0;
+}
+
+void nifs_free_name(char* name, const char* inline_name) {
+  if (name != inline_name) {
+    kfree(name);
+  }
+}
+
+int nifs_init_dir_index(struct nifs_dir_entry* dir) {
+  int ret = rhashtable_init(&dir->files_index, &nifs_files_index_params);
+  if (ret) {
+    return ret;
+  }
+
+  ret = rhashtable_init(&dir->subdirs_index, &nifs_subdirs_index_params);
+  if (ret) {
+    rhashtable_destroy(&dir->files_index);
+    return ret;
+  }
+
+  xa_init_flags(&dir->cookies, XA_FLAGS_ALLOC);
+  dir->next_cookie = NIFS_FIRST_COOKIE;
+  return 0;
+}
+
+void nifs_destroy_dir_index(struct nifs_dir_entry* dir) {
+  rhashtable_destroy(&dir->files_index);
+  rhashtable_destroy(&dir->subdirs_index);
+  xa_destroy(&dir->cookies);
+}
+
+// Cookies only grow (until they wrap), so a listing resumed from one never sees
+// an entry twice, and entries removed meanwhile simply drop out of it
+static int nifs_dir_alloc_cookie(struct nifs_dir_entry* dir, void* entry, u32* cookie) {
+  int ret = xa_alloc_cyclic(
+      &dir->cookies,
+      cookie,
+      entry,
+      XA_LIMIT(NIFS_FIRST_COOKIE, U32_MAX),
+      &dir->next_cookie,
+      GFP_KERNEL
+  );
+  return ret < 0 ? ret : 0;
+}
+
+int nifs_dir_add_file(struct nifs_dir_entry* dir, struct nifs_file_entry* file) {
+  int ret = rhashtable_insert_fast(&dir->files_index, &file->name_node, nifs_files_index_params);
+  if (ret) {
+    return ret;
+  }
+
+  ret = nifs_dir_alloc_cookie(dir, file, &file->cookie);
+  if (ret) {
+    rhashtable_remove_fast(&dir->files_index, &file->name_node, nifs_files_index_params);
+  }
+  return ret;
+}
+
+void nifs_dir_remove_file(struct nifs_dir_entry* dir, struct nifs_file_entry* file) {
+  xa_erase(&dir->cookies, file->cookie);
+  rhashtable_remove_fast(&dir->files_index, &file->name_node, nifs_files_index_params);
+}
+
+int nifs_dir_add_subdir(struct nifs_dir_entry* dir, struct nifs_dir_entry* subdir) {
+  int ret =
+      rhashtable_insert_fast(&dir->subdirs_index, &subdir->name_node, nifs_subdirs_index_params);
+  if (ret) {
+    return ret;
+  }
+
+  ret = nifs_dir_alloc_cookie(dir, xa_tag_pointer(subdir, NIFS_INODE_DIR), &subdir->cookie);
+  if (ret) {
+    rhashtable_remove_fast(&dir->subdirs_index, &subdir->name_node, nifs_subdirs_index_params);
+  }
+  return ret;
+}
+
+void nifs_dir_remove_subdir(struct nifs_dir_entry* dir, struct nifs_dir_entry* subdir) {
+  xa_erase(&dir->cookies, subdir->cookie);
+  rhashtable_remove_fast(&dir->subdirs_index, &subdir->name_node, nifs_subdirs_index_params);
+}
+
+// ====== ========== ======
+
+int nifs_index_directory(struct nifs_sb_info* sbi, struct nifs_dir_entry* dir) {
+  void* entry = xa_tag_pointer(dir, NIFS_INODE_DIR);
+  return xa_insert(&sbi->inodes, dir->inode_number, entry, GFP_KERNEL);
+}
+
+int nifs_index_file_data(struct nifs_sb_info* sbi, ulong inode, struct nifs_file_data* data) {
+  return xa_insert(&sbi->inodes, inode, data, GFP_KERNEL);
+}
+
+void nifs_unindex_inode(struct nifs_sb_info* sbi, ulong inode) {
+  xa_erase(&sbi->inodes, inode);
+}
+
+struct nifs_dir_entry* nifs_find_directory(struct nifs_sb_info* sbi, ulong inode) {
+  void* entry = xa_load(&sbi->inodes, inode);
+  if (!entry || xa_pointer_tag(entry) != NIFS_INODE_DIR) {
+    return NULL;
+  }
+  return xa_untag_pointer(entry);
+}
+
+struct nifs_file_entry* nifs_find_file_in_dir(struct nifs_dir_entry* dir, const char* name) {
+  struct qstr key = QSTR_INIT(name, strlen(name));
+  return nifs_find_file_in_dir_qstr(dir, &key);
 }
 
 struct nifs_dir_entry* nifs_find_subdir(struct nifs_dir_entry* dir, const char* name) {
+  struct qstr key = QSTR_INIT(name, strlen(name));
+  return nifs_find_subdir_qstr(dir, &key);
+}
+
+// name->hash is ignored, the index hashes names its own way
+struct nifs_file_entry* nifs_find_file_in_dir_qstr(
+    struct nifs_dir_entry* dir, const struct qstr* name
+) {
   if (!dir) {
     return NULL;
   }
 
-  struct nifs_dir_entry* subdir;
-  list_for_each_entry(subdir, &dir->subdirs, parent_list) {
-    if (strcmp(subdir->name, name) == 0) {
-      return subdir;
-    }
+  struct qstr key = QSTR_INIT(name->name, name->len);
+  key.hash = full_name_hash(NULL, name->name, name->len);
+  return rhashtable_lookup_fast(&dir->files_index, &key, nifs_files_index_params);
+}
+
+struct nifs_dir_entry* nifs_find_subdir_qstr(struct nifs_dir_entry* dir, const struct qstr* name) {
+  if (!dir) {
+    return NULL;
   }
-  return NULL;
+
+  struct qstr key = QSTR_INIT(name->name, name->len);
+  key.hash = full_name_hash(NULL, name->name, name->len);
+  return rhashtable_lookup_fast(&dir->subdirs_index, &key, nifs_subdirs_index_params);
 }
@@ -6,8 +6,32 @@
 #include <linux/types.h>
 #include <linux/list.h>
 
-struct nifs_dir_entry* nifs_find_directory(ulong inode);
+// The inode index of a mount, sbi->inodes
+int nifs_index_directory(struct nifs_sb_info* sbi, struct nifs_dir_entry* dir);
+int nifs_index_file_data(struct nifs_sb_info* sbi, ulong inode, struct nifs_file_data* data);
+void nifs_unindex_inode(struct nifs_sb_info* sbi, ulong inode);
+
+u32 nifs_name_hash(const char* name);
+int nifs_init_name(char** name, char* inline_name, const char* src);
+void nifs_free_name(char* name, const char* inline_name);
+
+int nifs_init_dir_index(struct nifs_dir_entry* dir);
+void nifs_destroy_dir_index(struct nifs_dir_entry* dir);
+
+// Adding and removing needs dir->lock held for writing. Finds are RCU-safe and need
+// either rcu_read_lock() or the lock; entries are freed only after a grace period
+int nifs_dir_add_file(struct nifs_dir_entry* dir, struct nifs_file_entry* file);
+void nifs_dir_remove_file(struct nifs_dir_entry* dir, struct nifs_file_entry* file);
+int nifs_dir_add_subdir(struct nifs_dir_entry* dir, struct nifs_dir_entry* subdir);
+void nifs_dir_remove_subdir(struct nifs_dir_entry* dir, struct nifs_dir_entry* subdir);
+
+struct nifs_dir_entry* nifs_find_directory(struct nifs_sb_info* sbi, ulong inode);
 struct nifs_file_entry* nifs_find_file_in_dir(struct nifs_dir_entry* dir, const char* name);
 struct nifs_dir_entry* nifs_find_subdir(struct nifs_dir_entry* dir, const char* name);
+// For names that are not NUL-terminated, such as those d_revalidate gets
+struct nifs_file_entry* nifs_find_file_in_dir_qstr(
+    struct nifs_dir_entry* dir, const struct qstr* name
+);
+struct nifs_dir_entry* nifs_find_subdir_qstr(struct nifs_dir_entry* dir, const struct qstr* name);
 
 #endif